@@ -1,9 +1,9 @@
-#include "memory.h"
+#include "slab.h"
 #include "arp.h"
 #include "byteswap.h"
 #include "protocol.h"
 #include "emac.h"
-#include "tick.h"
+#include "timer.h"
 #include "list.h"
 #include "init.h"
 #include "wait.h"
@@ -11,8 +11,6 @@
 
 #define ARP_TIMEOUT 250
 
-static WAITQUEUE(arp_waitqueue);
-
 struct arp_entry
 {
     uint8_t ether_addr[ETHER_ADDR_LEN];
@@ -22,34 +20,33 @@ struct arp_entry
 
 struct arp_pending_request
 {
-    int tick_count;
     int TPA;
     int timed_out;
     int finished;
     struct arp_entry *answer;
     list requests;
+
+    /* Gives up on the request after ARP_TIMEOUT ticks. */
+    struct timer timer;
+
+    /* The thread blocked in resolve_address() on this request. */
+    waitqueue_t waitq;
 };
 
+static SLAB_CACHE(arp_entry_cache, struct arp_entry);
+
 static LIST(arp_pending_requests);
 static LIST(arp_table_head);
 
-static void arp_tick()
+static void arp_request_expire(struct timer *timer)
 {
-    list *i, *tmp;
-    irq_flags_t flags = irq_disable();
-
-    list_for_each_safe(i, tmp, &arp_pending_requests) {
-        struct arp_pending_request *arp_req =
-            list_entry(i, struct arp_pending_request, requests);
+    struct arp_pending_request *arp_req =
+        list_entry(timer, struct arp_pending_request, timer);
 
-        if (arp_req->tick_count++ >= ARP_TIMEOUT) {
-            arp_req->finished = 1;
-            arp_req->timed_out = 1;
-            list_del(i);
-        }
-    }
-
-    irq_enable(flags);
+    arp_req->finished = 1;
+    arp_req->timed_out = 1;
+    list_del(&arp_req->requests);
+    waitqueue_wakeup_one(&arp_req->waitq);
 }
 
 static void arp_swap_endian(arp_packet *packet)
@@ -71,13 +68,22 @@ uint8_t * resolve_address(uint32_t ip_address)
 
     flags = irq_disable();
     list_for_each(cur, &arp_table_head, arp_table) {
-        if (cur->ipaddr == ip_address)
+        if (cur->ipaddr == ip_address) {
+            irq_enable(flags);
             return cur->ether_addr;
+        }
     }
     irq_enable(flags);
 
     /* Need to send out ARP packet to resolve address. */
-    arp_packet *arp_request = (arp_packet *)get_mem(sizeof(arp_packet));
+    struct packet_t *pkt = packet_alloc_tx(sizeof(arp_packet));
+    arp_packet *arp_request;
+
+    /* Out of memory, give up as if the request had timed out. */
+    if (!pkt)
+        return 0;
+
+    arp_request = (arp_packet *)pkt->cur_data;
 
     /* Fill in ARP request fields. */
     arp_request->HTYPE = HTYPE_ETHERNET;
@@ -96,17 +102,19 @@ uint8_t * resolve_address(uint32_t ip_address)
 
     memset(&arp_p_req, 0, sizeof(arp_p_req));
     arp_p_req.TPA = ip_address;
+    INIT_WAITQUEUE(&arp_p_req.waitq);
+    timer_init(&arp_p_req.timer, arp_request_expire);
 
     flags = irq_disable();
     list_add(&arp_p_req.requests, &arp_pending_requests);
+    timer_start(&arp_p_req.timer, ARP_TIMEOUT);
     irq_enable(flags);
 
     arp_swap_endian(arp_request);
 
-    ether_tx(broadcast_addr, ETHERTYPE_ARP, arp_request,
-             sizeof(*arp_request));
+    ether_tx(broadcast_addr, ETHERTYPE_ARP, pkt);
 
-    wait_for_volatile_condition(arp_p_req.finished, arp_waitqueue);
+    wait_for_volatile_condition(arp_p_req.finished, arp_p_req.waitq);
 
     if (arp_p_req.timed_out)
         return 0;
@@ -133,13 +141,20 @@ static void arp_rx_packet(struct packet_t *pkt)
     {
     case OPER_REQUEST:
     {
+        struct packet_t *resp_pkt;
         arp_packet *resp;
         int i;
 
         if (packet->TPA != OUR_IP_ADDRESS)
             return;
 
-        resp = get_mem(sizeof(*resp));
+        resp_pkt = packet_alloc_tx(sizeof(*resp));
+
+        /* Out of memory, the requester will ask again. */
+        if (!resp_pkt)
+            return;
+
+        resp = (arp_packet *)resp_pkt->cur_data;
 
         resp->HTYPE = HTYPE_ETHERNET;
         resp->PTYPE = ETHERTYPE_IP;
@@ -157,7 +172,7 @@ static void arp_rx_packet(struct packet_t *pkt)
 
         arp_swap_endian(resp);
 
-        ether_tx(packet->SHA, ETHERTYPE_ARP, resp, sizeof(*resp));
+        ether_tx(packet->SHA, ETHERTYPE_ARP, resp_pkt);
         break;
     }
     case OPER_REPLY:
@@ -179,7 +194,11 @@ static void arp_rx_packet(struct packet_t *pkt)
 
             if (arp_req->TPA == packet->SPA) {
 
-                new_arp_entry = get_mem(sizeof(*new_arp_entry));
+                new_arp_entry = slab_alloc(&arp_entry_cache);
+
+                /* Out of memory, leave the request to time out. */
+                if (!new_arp_entry)
+                    break;
 
                 ethernet_mac_copy(new_arp_entry->ether_addr, packet->SHA);
                 new_arp_entry->ipaddr = packet->SPA;
@@ -191,12 +210,13 @@ static void arp_rx_packet(struct packet_t *pkt)
                 arp_req->answer = new_arp_entry;
                 arp_req->finished = 1;
 
+                timer_stop(&arp_req->timer);
                 list_del(i);
+                waitqueue_wakeup_one(&arp_req->waitq);
                 break;
             }
         }
 
-        waitqueue_wakeup(&arp_waitqueue);
         irq_enable(flags);
     }
     default:
@@ -209,13 +229,8 @@ struct protocol_t arp_protocol = {
     .rx_pkt = arp_rx_packet
 };
 
-struct tick_work_q arp_tick_work = {
-    .tick_fn = arp_tick
-};
-
 static void arp_init(void)
 {
-    tick_add_work_fn(&arp_tick_work);
     protocol_register(&arp_protocol);
 }
 initcall(arp_init);
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdint.h>
+
+/* Host stand-in for irq.h, for code built into the host benchmarks.
+ * They are single threaded, so there is nothing to mask. */
+
+typedef uint32_t irq_flags_t;
+
+static inline irq_flags_t irq_disable()
+{
+    return 0;
+}
+
+static inline void irq_enable(irq_flags_t state)
+{
+    (void)state;
+}
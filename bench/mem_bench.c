@@ -0,0 +1,270 @@
+/* Host benchmark for the heap allocator.
+ *
+ * Replays a fixed allocation trace against memory.c and reports the
+ * average time taken per request and how fragmented the heap gets.
+ * Then times the worst case of the first-fit allocator, a request that
+ * only the last of many free blocks can satisfy.  Build it
+ * with `make mem-bench', which runs it once against the segregated fit
+ * allocator and once against the first-fit one it replaced.
+ *
+ * The trace is made up to look like the stack's own use of the heap:
+ * mostly small control blocks, some small buffers, and a share of full
+ * size frames, freed in random order.  It is generated up front from a
+ * fixed seed, so every run, and both allocators, see the same requests.
+ *
+ * The host is not the target.  Pointers and boundary tags are twice
+ * the size, there are no wait states, and the caches are much larger,
+ * so only the comparison between the two allocators means anything. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+
+/* The same size as the first-fit allocator's static heap. */
+#define HEAP_SIZE (16 * 1024)
+
+/* Number of objects that can be live at once. */
+#define SLOTS 64
+
+/* Requests in one replay of the trace, and number of replays timed. */
+#define TRACE_LEN 200000
+#define RUNS 20
+
+/* Free space is sampled every so many requests. */
+#define SAMPLE_INTERVAL 1000
+
+/* Size of the objects the heap is filled with for the worst case, of
+ * the large one, and of the request that can only be served by it. */
+#define WORST_SMALL_SIZE 16
+#define WORST_LARGE_SIZE 1536
+#define WORST_REQUEST_SIZE 1024
+#define WORST_RUNS 1000
+
+#define __STR(x) #x
+#define STR(x) __STR(x)
+
+/* Heap bounds, as the linker script would export them.  The second
+ * region is left empty, so that both allocators manage a single heap
+ * of the same size. */
+char _sheap_ram1[HEAP_SIZE] __attribute__((aligned(8)));
+char _sheap_ram2[8] __attribute__((aligned(8)));
+__asm__(".globl _eheap_ram1\n"
+        ".set _eheap_ram1, _sheap_ram1 + " STR(HEAP_SIZE) "\n"
+        ".globl _eheap_ram2\n"
+        ".set _eheap_ram2, _sheap_ram2\n");
+
+struct slot {
+    uint32_t *ptr;
+    uint32_t size;
+};
+
+/* A request frees the object in `slot' if there is one, or allocates
+ * `size' bytes for it otherwise. */
+struct trace_op {
+    uint16_t slot;
+    uint16_t size;
+};
+
+static struct slot slots[SLOTS];
+static struct trace_op trace[TRACE_LEN];
+static void *worst_objs[HEAP_SIZE / WORST_SMALL_SIZE];
+static uint32_t rand_state = 0x2545F491;
+
+/* xorshift32, good enough to shuffle the trace. */
+static uint32_t bench_rand(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static size_t bench_size(void)
+{
+    uint32_t r = bench_rand() % 100;
+
+    /* TCBs, timers, packet_t and the like. */
+    if (r < 60)
+        return 16 + bench_rand() % 81;
+
+    /* Small frames and socket buffers. */
+    if (r < 85)
+        return 128 + bench_rand() % 385;
+
+    /* Full size frames. */
+    return 1536;
+}
+
+static void trace_init(void)
+{
+    int i;
+
+    for (i = 0; i < TRACE_LEN; i++) {
+        trace[i].slot = bench_rand() % SLOTS;
+        trace[i].size = bench_size() & ~3;
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct bench_result {
+    uint64_t ns;
+    uint32_t allocs;
+    uint32_t failures;
+    uint32_t samples;
+    uint32_t fragmentation;
+    uint32_t free_blocks;
+    int corrupt;
+};
+
+/* Replay the trace once from an empty heap.  With `sample' set, the
+ * free space is looked at as it goes, and the replay isn't timed. */
+static void bench_replay(struct bench_result *res, int sample)
+{
+    struct mem_free_info info;
+    uint64_t start;
+    int i;
+
+    memset(&mem_stats, 0, sizeof(mem_stats));
+    memset(slots, 0, sizeof(slots));
+    mem_setup();
+
+    start = now_ns();
+
+    for (i = 0; i < TRACE_LEN; i++) {
+        struct slot *slot = &slots[trace[i].slot];
+
+        if (slot->ptr) {
+            /* Check the ends of the block haven't been overwritten. */
+            if (slot->ptr[0] != slot->size ||
+                slot->ptr[slot->size / 4 - 1] != ~slot->size)
+                res->corrupt = 1;
+
+            free_mem(slot->ptr);
+            slot->ptr = NULL;
+        } else {
+            slot->size = trace[i].size;
+            slot->ptr = get_mem(slot->size);
+            res->allocs++;
+
+            if (slot->ptr) {
+                slot->ptr[0] = slot->size;
+                slot->ptr[slot->size / 4 - 1] = ~slot->size;
+            }
+        }
+
+        if (sample && !(i % SAMPLE_INTERVAL)) {
+            mem_get_free_info(&info);
+            res->samples++;
+            res->fragmentation += info.fragmentation;
+            res->free_blocks += info.nr_free_blocks;
+        }
+    }
+
+    res->ns += now_ns() - start;
+    res->failures += mem_stats.failures;
+
+    /* Everything should coalesce back into a single block. */
+    for (i = 0; i < SLOTS; i++)
+        free_mem(slots[i].ptr);
+
+    mem_get_free_info(&info);
+
+    if (info.nr_free_blocks != 1 || info.free != mem_stats.heap_size)
+        res->corrupt = 1;
+}
+
+/* Leave the heap with every other small block free, and the one large
+ * free block last on the first-fit list, then time a request only the
+ * large block can satisfy.
+ *
+ * @returns -1 if the request failed.  Otherwise 0, with the time taken
+ * in `ns', in ns, and the number of free blocks in `nr_free_blocks'. */
+static int bench_worst_once(uint64_t *ns, unsigned int *nr_free_blocks)
+{
+    struct mem_free_info info;
+    uint64_t start;
+    void *large;
+    int i, n;
+
+    memset(&mem_stats, 0, sizeof(mem_stats));
+    mem_setup();
+
+    large = get_mem(WORST_LARGE_SIZE);
+
+    for (n = 0; n < HEAP_SIZE / WORST_SMALL_SIZE; n++) {
+        worst_objs[n] = get_mem(WORST_SMALL_SIZE);
+
+        if (!worst_objs[n])
+            break;
+    }
+
+    /* Free blocks go to the head of the list, so the large one ends up
+     * at the tail.  The small ones are kept apart so they don't merge. */
+    free_mem(large);
+
+    for (i = 1; i < n; i += 2)
+        free_mem(worst_objs[i]);
+
+    mem_get_free_info(&info);
+    *nr_free_blocks = info.nr_free_blocks;
+
+    start = now_ns();
+    large = get_mem(WORST_REQUEST_SIZE);
+    *ns = now_ns() - start;
+
+    return large ? 0 : -1;
+}
+
+int main(void)
+{
+    struct bench_result timed, sampled;
+    uint64_t worst_ns = 0, ns;
+    unsigned int worst_free_blocks = 0;
+    int i;
+
+    memset(&timed, 0, sizeof(timed));
+    memset(&sampled, 0, sizeof(sampled));
+
+    trace_init();
+
+    for (i = 0; i < RUNS; i++)
+        bench_replay(&timed, 0);
+
+    bench_replay(&sampled, 1);
+
+    for (i = 0; i < WORST_RUNS; i++) {
+        if (bench_worst_once(&ns, &worst_free_blocks))
+            sampled.corrupt = 1;
+
+        worst_ns += ns;
+    }
+
+    printf("%s: %u requests x %d runs\n", MEM_BENCH_NAME,
+           TRACE_LEN, RUNS);
+    printf("  %.1f ns per request\n",
+           (double)timed.ns / ((uint64_t)TRACE_LEN * RUNS));
+    printf("  failed    %6u of %u allocations per run\n",
+           sampled.failures, sampled.allocs);
+    printf("  fragmentation %3u%%, %u free blocks on average\n",
+           sampled.fragmentation / sampled.samples,
+           sampled.free_blocks / sampled.samples);
+    printf("  worst case %.1f ns, with %u free blocks\n",
+           (double)worst_ns / WORST_RUNS, worst_free_blocks);
+
+    if (timed.corrupt || sampled.corrupt) {
+        printf("  heap corrupted\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,15 +1,85 @@
 #include "lpc17xx.h"
 #include "arp.h"
-#include "memory.h"
+#include "emac.h"
+#include "pbuf.h"
 #include "byteswap.h"
 #include "protocol.h"
 #include "init.h"
+#include "timer.h"
+#include "tasklet.h"
+#include "irq.h"
+#include "list.h"
+#include "wait.h"
 #include <string.h>
 
-#define DESC_LEN 12
-#define RX_FRAG_BUF_SZ 127
+#define DESC_LEN (EMAC_TX_MAX_FRAMES + 1)
+#ifndef EMAC_RX_FRAGS
+#define RX_DESC_LEN 4
+#else
+#define RX_DESC_LEN 12
+#endif
 #define PHY_ADDR 1
 
+/* How often, in ticks, the PHY state machine is stepped. */
+#define PHY_POLL_TICKS 20
+
+/* PHY status register and its bits. */
+#define PHY_STS 0x10
+#define PHY_STS_LINK (1 << 0)
+#define PHY_STS_10MBPS (1 << 1)
+#define PHY_STS_FULL_DUPLEX (1 << 2)
+#define PHY_STS_AUTONEG_DONE (1 << 4)
+
+/* The largest frame the MAC will accept, the reset value of MAXF. */
+#define RX_FRAME_MAX PBUF_MTU_SZ
+
+#ifndef EMAC_RX_FRAGS
+/* Each receive buffer holds a whole frame, so that a frame is always
+ * described by a single descriptor. */
+#define RX_BUF_SZ RX_FRAME_MAX
+#else
+/* The old receive path, kept to measure the current one against:
+ * frames are split over small buffers and gathered by copying. */
+#define RX_BUF_SZ PBUF_SMALL_SZ
+#endif
+
+/* IntStatus, IntEnable and IntClear bits. */
+#define INT_RX_OVERRUN  (1 << 0)
+#define INT_RX_ERROR    (1 << 1)
+#define INT_RX_DONE     (1 << 3)
+#define INT_TX_UNDERRUN (1 << 4)
+#define INT_TX_ERROR    (1 << 5)
+#define INT_TX_DONE     (1 << 7)
+
+/* Receive status_info bits. */
+#define RX_INFO_CRC_ERR     (1 << 23)
+#define RX_INFO_SYMBOL_ERR  (1 << 24)
+#define RX_INFO_LENGTH_ERR  (1 << 25)
+#define RX_INFO_ALIGN_ERR   (1 << 27)
+#define RX_INFO_OVERRUN     (1 << 28)
+#define RX_INFO_NO_DESC     (1 << 29)
+#define RX_INFO_LAST_FLAG   (1 << 30)
+
+/* A frame with any of these set is dropped.  RangeError is left out:
+ * it is raised for every Ethernet II frame, as their type field is
+ * beyond the 802.3 length range. */
+#define RX_INFO_ERR_MASK (RX_INFO_CRC_ERR | RX_INFO_SYMBOL_ERR |    \
+                          RX_INFO_LENGTH_ERR | RX_INFO_ALIGN_ERR |  \
+                          RX_INFO_OVERRUN | RX_INFO_NO_DESC)
+
+/* Transmit status bits. */
+#define TX_STATUS_EXCESSIVE_DEFER     (1 << 26)
+#define TX_STATUS_EXCESSIVE_COLLISION (1 << 27)
+#define TX_STATUS_LATE_COLLISION      (1 << 28)
+#define TX_STATUS_UNDERRUN            (1 << 29)
+#define TX_STATUS_NO_DESC             (1 << 30)
+#define TX_STATUS_ERROR               (1 << 31)
+
+/* RxFilterCtrl bits. */
+#define RXFILTER_ACCEPT_BROADCAST  (1 << 1)
+#define RXFILTER_ACCEPT_MCAST_HASH (1 << 4)
+#define RXFILTER_ACCEPT_PERFECT    (1 << 5)
+
 static uint8_t mac_address[ETHER_ADDR_LEN] = {0, 1, 2, 3, 4, 5};
 
 typedef struct
@@ -25,14 +95,109 @@ typedef struct
 } rx_status_t;
 
 /* txrx descriptor arrays. */
-txrx_descriptor __attribute__((aligned(4))) tx_desc[DESC_LEN];
-txrx_descriptor __attribute__((aligned(4))) rx_desc[DESC_LEN];
-uint32_t        __attribute__((aligned(4))) tx_status[DESC_LEN];
-rx_status_t     __attribute__((aligned(8))) rx_status[DESC_LEN];
+txrx_descriptor __attribute__((aligned(4))) __ethram tx_desc[DESC_LEN];
+txrx_descriptor __attribute__((aligned(4))) __ethram rx_desc[RX_DESC_LEN];
+uint32_t        __attribute__((aligned(4))) __ethram tx_status[DESC_LEN];
+rx_status_t     __attribute__((aligned(8))) __ethram rx_status[RX_DESC_LEN];
 
 /* Our ethernet address, set at init time. */
 uint8_t ether_addr[ETHER_ADDR_LEN];
 
+/* Frames in flight, indexed by the TX descriptor holding their last
+ * buffer.  `tx_clean_idx' trails TxConsumeIndex and marks the next
+ * descriptor to reclaim once the hardware is done with it. */
+static struct packet_t *tx_pkts[DESC_LEN];
+static volatile int tx_clean_idx;
+static WAITQUEUE(tx_ring_waitq);
+
+/* Set by irq_enet() on a receive overrun, to have the next poll pass
+ * reset the receive datapath. */
+static volatile int rx_reset_pending;
+
+/* Set while skipping the remaining fragments of an oversized frame. */
+static int rx_dropping;
+
+struct emac_err_stats emac_err_stats;
+
+#ifdef EMAC_RX_BENCH
+/* Receive path cost, measured with the DWT cycle counter from the
+ * moment a filled descriptor is picked up to the moment its frame has
+ * been injected into the stack, summed over every descriptor of the
+ * frame.  Build with -DEMAC_RX_BENCH and divide cycles by frames to
+ * get the cost per frame; add -DEMAC_RX_FRAGS to get the same figures
+ * for the old fragment gathering path. */
+struct {
+    uint32_t frames;
+    uint32_t bytes;
+    uint32_t cycles;
+    uint32_t max_cycles;
+} emac_rx_bench;
+
+static void rx_bench_frame(uint32_t cycles, int frame_len)
+{
+    emac_rx_bench.frames++;
+    emac_rx_bench.bytes += frame_len;
+    emac_rx_bench.cycles += cycles;
+
+    if (cycles > emac_rx_bench.max_cycles)
+        emac_rx_bench.max_cycles = cycles;
+}
+#endif
+
+/* Number of multicast groups using each bit of the hash filter. */
+static uint8_t mcast_hash_refs[64];
+
+/* The hash filter is indexed by bits 28:23 of the standard Ethernet
+ * CRC of the destination address. */
+static int mcast_hash_idx(const uint8_t *addr)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    int i, bit;
+
+    for (i = 0; i < ETHER_ADDR_LEN; i++)
+        for (bit = 0; bit < 8; bit++) {
+            if (((crc >> 31) ^ (addr[i] >> bit)) & 1)
+                crc = (crc << 1) ^ 0x04C11DB7;
+            else
+                crc <<= 1;
+        }
+
+    return (crc >> 23) & 0x3F;
+}
+
+static void mcast_hash_set(int idx, int enable)
+{
+    volatile uint32_t *reg = idx < 32 ? &LPC_EMAC->HashFilterL :
+        &LPC_EMAC->HashFilterH;
+
+    if (enable)
+        *reg |= (1 << (idx % 32));
+    else
+        *reg &= ~(1 << (idx % 32));
+}
+
+void emac_mcast_add(const uint8_t *addr)
+{
+    int idx = mcast_hash_idx(addr);
+    irq_flags_t flags = irq_disable();
+
+    if (!mcast_hash_refs[idx]++)
+        mcast_hash_set(idx, 1);
+
+    irq_enable(flags);
+}
+
+void emac_mcast_del(const uint8_t *addr)
+{
+    int idx = mcast_hash_idx(addr);
+    irq_flags_t flags = irq_disable();
+
+    if (mcast_hash_refs[idx] && !--mcast_hash_refs[idx])
+        mcast_hash_set(idx, 0);
+
+    irq_enable(flags);
+}
+
 static void phy_write(int reg, int writeval)
 {
     LPC_EMAC->MCMD = 0;
@@ -50,56 +215,507 @@ static unsigned short phy_read(unsigned char reg)
     return (LPC_EMAC->MRDD);
 }
 
-void irq_enet()
+static void tx_flush(void);
+
+static enum {
+    PHY_RESET,
+    PHY_LINK_DOWN,
+    PHY_LINK_UP
+} phy_state;
+
+static uint16_t phy_link_params;
+static volatile int link_up;
+
+struct emac_link_stats emac_link_stats;
+
+/* Program the MAC for the speed and duplex the PHY negotiated. */
+static void link_configure(uint16_t link_params)
+{
+    if (!(link_params & PHY_STS_10MBPS))
+        /* Link speed is 100 Mbps. */
+        LPC_EMAC->SUPP = (1 << 8);
+    else
+        /* Link speed is 10 Mbps. */
+        LPC_EMAC->SUPP = 0;
+
+    if (link_params & PHY_STS_FULL_DUPLEX) {
+        /* Link is full-duplex. */
+        LPC_EMAC->MAC2 |= 1;
+        LPC_EMAC->Command |= (1 << 10);
+        LPC_EMAC->IPGT = 0x15;
+    } else {
+        LPC_EMAC->MAC2 &= ~1;
+        LPC_EMAC->Command &= ~(1 << 10);
+        LPC_EMAC->IPGT = 0x12;
+    }
+
+    phy_link_params = link_params;
+}
+
+static void link_set_up(uint16_t link_params)
 {
-    static void *current_frame = 0;
-    static int current_frame_len = 0;
+    link_configure(link_params);
 
-    while (LPC_EMAC->RxConsumeIndex != LPC_EMAC->RxProduceIndex) {
-        int desc_idx = LPC_EMAC->RxConsumeIndex,
-            frag_len = (rx_status[desc_idx].status_info & 0x7FF) + 1;
-        void *frag = rx_desc[desc_idx].packet;
+    /* Start transmitting. */
+    LPC_EMAC->Command |= (1 << 1);
 
-        /* Gather the new fragment out of DMA memory. */
-        if (current_frame) {
-            void *new_frame_buf;
+    link_up = 1;
+    emac_link_stats.up_events++;
+}
+
+static void link_set_down(void)
+{
+    link_up = 0;
+    emac_link_stats.down_events++;
 
-            new_frame_buf = get_mem(current_frame_len + frag_len);
-            memcpy(new_frame_buf, current_frame, current_frame_len);
-            memcpy(new_frame_buf + frag_len, frag, frag_len);
+    /* Stop transmitting and give back whatever was still queued in
+     * the ring; it would never go out. */
+    LPC_EMAC->Command &= ~(1 << 1);
+    tx_flush();
+}
 
-            free_mem(current_frame);
+/* Step the PHY management state machine.  Run from a timer, so it
+ * must never wait on the PHY. */
+static void phy_tick(struct timer *timer)
+{
+    uint16_t link_params;
 
-            current_frame_len += frag_len;
-            current_frame = new_frame_buf;
-        } else {
-            current_frame = get_mem(frag_len);
-            memcpy(current_frame, frag, frag_len);
-            current_frame_len = frag_len;
+    switch (phy_state) {
+    case PHY_RESET:
+        /* Wait for the PHY to come out of reset, then enable auto
+         * negotiation. */
+        if (phy_read(0) & (1 << 15))
+            break;
+
+        phy_write(0, (1 << 12));
+        phy_state = PHY_LINK_DOWN;
+        break;
+
+    case PHY_LINK_DOWN:
+        /* Wait for the link to become ready and auto negotiation to
+         * complete. */
+        link_params = phy_read(PHY_STS);
+
+        if ((link_params & PHY_STS_LINK) &&
+            (link_params & PHY_STS_AUTONEG_DONE)) {
+            link_set_up(link_params);
+            phy_state = PHY_LINK_UP;
         }
+        break;
+
+    case PHY_LINK_UP:
+        link_params = phy_read(PHY_STS);
+
+        if (!(link_params & PHY_STS_LINK)) {
+            link_set_down();
+            phy_state = PHY_LINK_DOWN;
+        } else if ((link_params ^ phy_link_params) &
+                   (PHY_STS_10MBPS | PHY_STS_FULL_DUPLEX)) {
+            /* The link was renegotiated. */
+            link_configure(link_params);
+            emac_link_stats.changes++;
+        }
+        break;
+    }
+}
+
+static struct timer phy_timer;
+
+int emac_link_is_up(void)
+{
+    return link_up;
+}
+
+#ifndef EMAC_RX_FRAGS
+/* Hand the frame described by the receive descriptor `desc_idx' up
+ * the stack. */
+static void rx_frame(int desc_idx)
+{
+    int frame_len = (rx_status[desc_idx].status_info & 0x7FF) + 1;
+    void *frame = rx_desc[desc_idx].packet;
+    struct packet_t *pkt = NULL;
+    void *refill;
+#ifdef EMAC_RX_BENCH
+    uint32_t start_cycles = LPC_DWT->CYCCNT;
+#endif
+
+    /* Pass the DMA buffer itself up the stack and refill the
+     * descriptor with a fresh buffer from the pool.  Should memory
+     * be short, drop the frame and leave its buffer on the ring. */
+    refill = pbuf_alloc_rx(RX_BUF_SZ);
+
+    if (refill)
+        pkt = packet_create(frame, frame_len);
+
+    if (!pkt) {
+        pbuf_free(refill);
+        emac_err_stats.rx_no_mem++;
+        return;
+    }
+
+    rx_desc[desc_idx].packet = refill;
+    packet_inject(pkt, ETHERNET);
+
+#ifdef EMAC_RX_BENCH
+    rx_bench_frame(LPC_DWT->CYCCNT - start_cycles, frame_len);
+#endif
+}
+#else
+/* The frame gathered so far. */
+static void *rx_gather_buf;
+static int rx_gather_len;
+#ifdef EMAC_RX_BENCH
+static uint32_t rx_gather_cycles;
+#endif
+
+/* Throw away a partly gathered frame. */
+static void rx_gather_drop(void)
+{
+    pbuf_free(rx_gather_buf);
+    rx_gather_buf = NULL;
+    rx_gather_len = 0;
+#ifdef EMAC_RX_BENCH
+    rx_gather_cycles = 0;
+#endif
+}
+
+/* Copy the fragment in the receive descriptor `desc_idx' out of DMA
+ * memory, appending it to the frame being gathered, as the receive
+ * path did before whole frame buffers.  The frame gathered so far is
+ * reallocated and re-copied for every fragment.  Once the last
+ * fragment has been gathered, the frame is injected into the stack. */
+static void rx_gather_frag(int desc_idx)
+{
+    uint32_t info = rx_status[desc_idx].status_info;
+    int frag_len = (info & 0x7FF) + 1;
+    void *frag = rx_desc[desc_idx].packet, *buf;
+    struct packet_t *pkt = NULL;
+#ifdef EMAC_RX_BENCH
+    uint32_t start_cycles = LPC_DWT->CYCCNT;
+#endif
+
+    buf = pbuf_alloc(rx_gather_len + frag_len);
+
+    if (!buf) {
+        rx_gather_drop();
+        rx_dropping = !(info & RX_INFO_LAST_FLAG);
+        emac_err_stats.rx_no_mem++;
+        return;
+    }
+
+    if (rx_gather_buf)
+        memcpy(buf, rx_gather_buf, rx_gather_len);
+
+    memcpy(buf + rx_gather_len, frag, frag_len);
+    pbuf_free(rx_gather_buf);
+
+    rx_gather_buf = buf;
+    rx_gather_len += frag_len;
+
+    if (info & RX_INFO_LAST_FLAG) {
+        pkt = packet_create(rx_gather_buf, rx_gather_len);
+
+        if (!pkt) {
+            rx_gather_drop();
+            emac_err_stats.rx_no_mem++;
+            return;
+        }
+
+        packet_inject(pkt, ETHERNET);
+    }
 
-        /* Do we have a full frame? */
-        if (rx_status[desc_idx].status_info & (1 << 30)) {
-            struct packet_t *pkt = packet_create(current_frame,
-                                                 current_frame_len);
+#ifdef EMAC_RX_BENCH
+    rx_gather_cycles += LPC_DWT->CYCCNT - start_cycles;
 
-            packet_inject(pkt, ETHERNET);
-            current_frame = 0;
-            current_frame_len = 0;
+    if (pkt)
+        rx_bench_frame(rx_gather_cycles, rx_gather_len);
+#endif
+
+    /* The buffer now belongs to the packet. */
+    if (pkt) {
+        rx_gather_buf = NULL;
+        rx_gather_drop();
+    }
+}
+#endif
+
+/* Number of TX descriptors that are neither in flight nor waiting to
+ * be reclaimed.  One descriptor is always left unused so that a full
+ * ring can be told apart from an empty one. */
+static int tx_free_descs(void)
+{
+    return (tx_clean_idx - LPC_EMAC->TxProduceIndex - 1 + DESC_LEN)
+        % DESC_LEN;
+}
+
+/* Count the errors reported in a sent frame's status word. */
+static void tx_account_status(uint32_t status)
+{
+    if (!(status & TX_STATUS_ERROR))
+        return;
+
+    emac_err_stats.tx_error++;
+
+    if (status & TX_STATUS_LATE_COLLISION)
+        emac_err_stats.tx_late_collision++;
+    if (status & TX_STATUS_EXCESSIVE_COLLISION)
+        emac_err_stats.tx_excessive_collision++;
+    if (status & TX_STATUS_EXCESSIVE_DEFER)
+        emac_err_stats.tx_excessive_defer++;
+    if (status & (TX_STATUS_UNDERRUN | TX_STATUS_NO_DESC))
+        emac_err_stats.tx_underrun++;
+}
+
+/* Complete every frame the hardware has finished sending and wake
+ * anyone waiting for space in the ring. */
+static void tx_reclaim(void)
+{
+    int consume_idx = LPC_EMAC->TxConsumeIndex;
+
+    while (tx_clean_idx != consume_idx) {
+        struct packet_t *pkt = tx_pkts[tx_clean_idx];
+
+        if (pkt) {
+            tx_account_status(tx_status[tx_clean_idx]);
+            tx_pkts[tx_clean_idx] = NULL;
+            packet_destroy(pkt);
         }
 
+        tx_clean_idx = (tx_clean_idx + 1) % DESC_LEN;
+    }
+
+    waitqueue_wakeup(&tx_ring_waitq);
+}
+
+/* Empty the ring of frames the hardware has not sent, completing them
+ * as if they had been.  Transmission must already be disabled. */
+static void tx_flush(void)
+{
+    int produce_idx = LPC_EMAC->TxProduceIndex;
+    irq_flags_t flags = irq_disable();
+
+    LPC_EMAC->TxProduceIndex = LPC_EMAC->TxConsumeIndex;
+
+    while (tx_clean_idx != produce_idx) {
+        struct packet_t *pkt = tx_pkts[tx_clean_idx];
+
+        if (pkt) {
+            tx_pkts[tx_clean_idx] = NULL;
+            packet_destroy(pkt);
+            emac_link_stats.tx_flushed++;
+        }
+
+        tx_clean_idx = (tx_clean_idx + 1) % DESC_LEN;
+    }
+
+    tx_clean_idx = LPC_EMAC->TxConsumeIndex;
+    irq_enable(flags);
+
+    waitqueue_wakeup(&tx_ring_waitq);
+}
+
+/* Recover from a TX underrun by resetting the transmit datapath.
+ * Frames still in the ring are dropped. */
+static void tx_reset(void)
+{
+    LPC_EMAC->Command &= ~(1 << 1);
+    tx_flush();
+
+    /* TxReset */
+    LPC_EMAC->Command |= (1 << 4);
+
+    LPC_EMAC->TxDescriptor = (uint32_t)tx_desc;
+    LPC_EMAC->TxStatus = (uint32_t)tx_status;
+    LPC_EMAC->TxDescriptorNumber = DESC_LEN - 1;
+    LPC_EMAC->TxProduceIndex = 0;
+    tx_clean_idx = 0;
+
+    if (link_up)
+        LPC_EMAC->Command |= (1 << 1);
+
+    emac_err_stats.tx_resets++;
+}
+
+/* Recover from an RX overrun by resetting the receive datapath.  The
+ * buffers stay with their descriptors, anything in them is lost.
+ * Must only be called by the receive poll function, the ring's sole
+ * consumer. */
+static void rx_reset(void)
+{
+    int i;
+    irq_flags_t flags;
+
+    /* irq_enet() updates the same registers; keep it from losing
+     * either write. */
+    flags = irq_disable();
+
+    LPC_EMAC->Command &= ~1;
+    LPC_EMAC->MAC1 &= ~1;
+
+    /* RxReset */
+    LPC_EMAC->Command |= (1 << 5);
+
+    for (i = 0; i < RX_DESC_LEN; i++)
+        rx_desc[i].control = (RX_BUF_SZ - 1) | (1 << 31);
+
+    LPC_EMAC->RxDescriptor = (uint32_t)rx_desc;
+    LPC_EMAC->RxStatus = (uint32_t)rx_status;
+    LPC_EMAC->RxDescriptorNumber = RX_DESC_LEN - 1;
+    LPC_EMAC->RxConsumeIndex = 0;
+    rx_dropping = 0;
+#ifdef EMAC_RX_FRAGS
+    rx_gather_drop();
+#endif
+
+    LPC_EMAC->MAC1 |= 1;
+    LPC_EMAC->Command |= 1;
+
+    irq_enable(flags);
+
+    emac_err_stats.rx_resets++;
+}
+
+static void rx_account_errors(uint32_t info)
+{
+    emac_err_stats.rx_error++;
+
+    if (info & RX_INFO_CRC_ERR)
+        emac_err_stats.rx_crc++;
+    if (info & RX_INFO_SYMBOL_ERR)
+        emac_err_stats.rx_symbol++;
+    if (info & RX_INFO_LENGTH_ERR)
+        emac_err_stats.rx_length++;
+    if (info & RX_INFO_ALIGN_ERR)
+        emac_err_stats.rx_alignment++;
+    if (info & RX_INFO_OVERRUN)
+        emac_err_stats.rx_overrun++;
+    if (info & RX_INFO_NO_DESC)
+        emac_err_stats.rx_no_desc++;
+}
+
+/* Receive poll function, run by the rx task once irq_enet() has
+ * scheduled it.  Hands up to `budget' frames up the stack.  Once the
+ * ring has been drained, receive interrupts are re-enabled.
+ *
+ * @returns the number of descriptors consumed. */
+static int emac_rx_poll(int budget)
+{
+    int work = 0;
+
+    if (rx_reset_pending) {
+        rx_reset_pending = 0;
+        rx_reset();
+    }
+
+    while (work < budget &&
+           LPC_EMAC->RxConsumeIndex != LPC_EMAC->RxProduceIndex) {
+        int desc_idx = LPC_EMAC->RxConsumeIndex;
+        uint32_t info = rx_status[desc_idx].status_info;
+
+#ifdef EMAC_RX_FRAGS
+        if (rx_dropping)
+            rx_dropping = !(info & RX_INFO_LAST_FLAG);
+        else if (info & RX_INFO_ERR_MASK) {
+            rx_account_errors(info);
+            rx_gather_drop();
+            rx_dropping = !(info & RX_INFO_LAST_FLAG);
+        } else
+            rx_gather_frag(desc_idx);
+#else
+        /* Frames are never larger than a receive buffer, so a frame
+         * that spills over into further descriptors is oversized.
+         * Drop every fragment of it. */
+        if (rx_dropping || !(info & RX_INFO_LAST_FLAG)) {
+            if (!rx_dropping)
+                emac_err_stats.rx_oversize++;
+
+            rx_dropping = !(info & RX_INFO_LAST_FLAG);
+        } else if (info & RX_INFO_ERR_MASK)
+            rx_account_errors(info);
+        else
+            rx_frame(desc_idx);
+#endif
+
         desc_idx += 1;
-        desc_idx %= DESC_LEN;
+        desc_idx %= RX_DESC_LEN;
         LPC_EMAC->RxConsumeIndex = desc_idx;
+        work++;
+    }
+
+    /* The ring is empty, go back to being interrupt driven.  RxDone
+     * is latched in IntStatus even while masked, so a frame that
+     * arrived since the last check raises the interrupt straight
+     * away. */
+    if (work < budget) {
+        irq_flags_t flags = irq_disable();
+        LPC_EMAC->IntEnable |= INT_RX_DONE;
+        irq_enable(flags);
+    }
+
+    return work;
+}
+
+/* Interrupt status left for the EMAC tasklet to handle. */
+static volatile uint32_t emac_irq_status;
+
+/* Transmit completion and error recovery, deferred from irq_enet(). */
+static void emac_tasklet_fn(struct tasklet *tasklet)
+{
+    irq_flags_t flags = irq_disable();
+    uint32_t status = emac_irq_status;
+
+    emac_irq_status = 0;
+    irq_enable(flags);
+
+    /* TxDone */
+    if (status & (INT_TX_DONE | INT_TX_ERROR))
+        tx_reclaim();
+
+    /* An underrun is fatal for the transmit datapath. */
+    if (status & INT_TX_UNDERRUN)
+        tx_reset();
+}
+
+static TASKLET(emac_tasklet, emac_tasklet_fn);
+
+void irq_enet()
+{
+    uint32_t status = LPC_EMAC->IntStatus & LPC_EMAC->IntEnable;
+
+    LPC_EMAC->IntClear = status;
+
+    /* A receive overrun leaves the receive datapath stuck until it is
+     * reset.  Leave that to the poll function, which owns the ring. */
+    if (status & INT_RX_OVERRUN) {
+        emac_err_stats.rx_overrun_irqs++;
+        rx_reset_pending = 1;
+        status |= INT_RX_DONE;
     }
 
-    LPC_EMAC->IntClear = (1 << 3);
+    /* RxDone: mask further receive interrupts and leave the ring to
+     * be polled from the rx task until it has been drained. */
+    if (status & INT_RX_DONE) {
+        LPC_EMAC->IntEnable &= ~INT_RX_DONE;
+        packet_rx_schedule(emac_rx_poll);
+    }
+
+    if (status & INT_TX_ERROR)
+        emac_err_stats.tx_error_irqs++;
+
+    if (status & INT_TX_UNDERRUN)
+        emac_err_stats.tx_underrun_irqs++;
+
+    /* Freeing sent frames and resetting the transmit datapath are
+     * left to the tasklet. */
+    if (status & (INT_TX_DONE | INT_TX_ERROR | INT_TX_UNDERRUN)) {
+        emac_irq_status |= status;
+        tasklet_schedule(&emac_tasklet);
+    }
 }
 
 void emac_init()
 {
     int i;
-    uint16_t link_params;
 
     /* Enable ethernet power. */
     LPC_SC->PCONP |= (1 << 30);
@@ -114,6 +730,9 @@ void emac_init()
     /* Enable automatic CRC, PADding.  */
     LPC_EMAC->MAC2 |= 1 | (1 << 4) | (1 << 5);
 
+    /* Never accept a frame larger than a receive buffer. */
+    LPC_EMAC->MAXF = RX_FRAME_MAX;
+
     /* Set the interframe gap time */
     LPC_EMAC->IPGT = 0x15;
     LPC_EMAC->IPGR = 0x12 | (0xC << 8);
@@ -121,50 +740,36 @@ void emac_init()
     /* Enable RMII. */
     LPC_EMAC->Command |= (1 << 9);
 
-    /* Reset the PHY. */
+    /* Reset the PHY.  phy_tick() takes it from here, bringing the
+     * link up once auto negotiation completes. */
+    phy_state = PHY_RESET;
     phy_write(0, (1 << 15));
-
-    /* Wait for the PHY to come out of reset. */
-    while(phy_read(0) & (1 << 15)) {};
-
-    /* Enable auto negotiation */
-    phy_write(0, (1 << 12));
-
-    /* Wait for link to become ready and auto negotiation to
-     * complete. */
-    while (!(phy_read(0x10) & ((1 << 0) | (1 << 4)))) {};
-
-    /* Get link parameters */
-    link_params = phy_read(0x10);
-
-    if (!(link_params & (1 << 1)))
-        /* Link speed is 100 Mbps. */
-        LPC_EMAC->SUPP = (1 << 8);
-    else
-        /* Link speed is 10 Mbps. */
-        LPC_EMAC->SUPP = 0;
-
-    if (link_params & (1 << 2))
-        /* Link is full-duplex. */
-        LPC_EMAC->Command |= (1 << 10);
-    else
-        LPC_EMAC->Command &= ~(1 << 10);
-
-    /* Set the station address. */
-    LPC_EMAC->SA0 = (mac_address[0] << 8) | mac_address[1];
-    LPC_EMAC->SA1 = (mac_address[2] << 8) | mac_address[3];
-    LPC_EMAC->SA2 = (mac_address[4] << 8) | mac_address[5];
-
-    /* Allocate the receive fragment buffers. */
-    for (i = 0; i < DESC_LEN; i++) {
-        rx_desc[i].packet = get_mem(RX_FRAG_BUF_SZ);
-        rx_desc[i].control = (RX_FRAG_BUF_SZ - 1) | (1 << 31);
-    }
+    timer_init(&phy_timer, phy_tick);
+    timer_start_periodic(&phy_timer, PHY_POLL_TICKS);
 
     /* Copy to our static mac address variable. */
     for (i = 0; i < ETHER_ADDR_LEN; i++)
         ether_addr[i] = mac_address[i];
 
+    /* Set the station address. */
+    LPC_EMAC->SA0 = (ether_addr[0] << 8) | ether_addr[1];
+    LPC_EMAC->SA1 = (ether_addr[2] << 8) | ether_addr[3];
+    LPC_EMAC->SA2 = (ether_addr[4] << 8) | ether_addr[5];
+
+    /* Have the MAC drop anything that isn't for us: accept only
+     * frames matching the station address, broadcasts, and multicast
+     * groups set up in the hash filter, which starts out empty. */
+    LPC_EMAC->HashFilterL = 0;
+    LPC_EMAC->HashFilterH = 0;
+    LPC_EMAC->RxFilterCtrl = RXFILTER_ACCEPT_BROADCAST |
+        RXFILTER_ACCEPT_MCAST_HASH | RXFILTER_ACCEPT_PERFECT;
+
+    /* Allocate the receive frame buffers. */
+    for (i = 0; i < RX_DESC_LEN; i++) {
+        rx_desc[i].packet = pbuf_alloc_rx(RX_BUF_SZ);
+        rx_desc[i].control = (RX_BUF_SZ - 1) | (1 << 31);
+    }
+
     /* Set the txrx desc base address. */
     LPC_EMAC->RxDescriptor = (uint32_t)rx_desc;
     LPC_EMAC->TxDescriptor = (uint32_t)tx_desc;
@@ -172,7 +777,7 @@ void emac_init()
     LPC_EMAC->RxStatus = (uint32_t)rx_status;
 
     /* Set the txrx desc array length. */
-    LPC_EMAC->RxDescriptorNumber = DESC_LEN - 1;
+    LPC_EMAC->RxDescriptorNumber = RX_DESC_LEN - 1;
     LPC_EMAC->TxDescriptorNumber = DESC_LEN - 1;
 
     /* Zero the indices. */
@@ -182,36 +787,107 @@ void emac_init()
     /* Set RECEIVE_ENABLE */
     LPC_EMAC->MAC1 |= 1;
 
-    /* Enable interrupts on rx. */
-    LPC_EMAC->IntEnable |= (1 << 3);
-
-    /* Enable Tx & Rx! */
-    LPC_EMAC->Command |= 3 | (1 << 9) | (1 << 7);
+    /* Enable interrupts on rx and tx completion and errors.  RxError
+     * is left masked: it is raised along with RangeError, so for
+     * every Ethernet II frame.  Per-frame receive errors are
+     * accounted for from the descriptor status when polled. */
+    LPC_EMAC->IntEnable |= INT_RX_OVERRUN | INT_RX_DONE |
+        INT_TX_UNDERRUN | INT_TX_ERROR | INT_TX_DONE;
+
+    /* Enable Rx!  Tx is enabled once the link comes up.  PassRxFilter
+     * is left clear so that received frames go through the receive
+     * filter. */
+    LPC_EMAC->Command |= 1 | (1 << 9);
+
+#ifdef EMAC_RX_BENCH
+    /* Start the DWT cycle counter. */
+    LPC_COREDEBUG->DEMCR |= DEMCR_TRCENA_MASK;
+    LPC_DWT->CYCCNT = 0;
+    LPC_DWT->CTRL |= DWT_CTRL_CYCCNTENA_MASK;
+#endif
 
     /* Enable Ethernet Mac interrupts. */
     LPC_NVIC->ISER0 = (1 << 28);
 }
 initcall(emac_init);
 
-void emac_xmit_frame(ethernet_header *header,
-                     void *payload, int payload_len)
+/* @returns the number of TX descriptors `pkt' needs, one per buffer. */
+static int tx_pkt_descs(struct packet_t *pkt)
+{
+    return 1 + pkt->nr_frags;
+}
+
+/* Point the TX descriptor `desc_idx' at one buffer of a frame. */
+static void tx_set_desc(int desc_idx, void *buf, size_t len)
+{
+    tx_desc[desc_idx].packet = buf;
+    tx_desc[desc_idx].control = len - 1;
+}
+
+int emac_xmit_frames(struct packet_t **pkts, int npkts)
 {
-    int desc_idx;
+    int desc_idx, used = 0, i;
+    irq_flags_t flags;
+
+    if (npkts <= 0)
+        return 0;
+
+    /* Wait for room in the ring for at least the first frame. */
+    wait_for_volatile_condition(!link_up ||
+                                tx_free_descs() >= tx_pkt_descs(pkts[0]),
+                                tx_ring_waitq);
+
+    /* Keep the link state and the ring steady while filling it. */
+    flags = irq_disable();
+
+    /* Don't queue anything into the ring while the link is down.
+     * Drop the frames instead. */
+    if (!link_up) {
+        for (i = 0; i < npkts; i++) {
+            packet_destroy(pkts[i]);
+            emac_link_stats.tx_flushed++;
+        }
+
+        irq_enable(flags);
+        return npkts;
+    }
 
-    /* Set the descriptor for the header. */
     desc_idx = LPC_EMAC->TxProduceIndex % DESC_LEN;
-    tx_desc[desc_idx].packet = header;
-    tx_desc[desc_idx].control = sizeof(*header) - 1;
 
-    /* Set the descriptor for the payload packet. */
-    desc_idx = (LPC_EMAC->TxProduceIndex + 1) % DESC_LEN;
-    tx_desc[desc_idx].packet = payload;
-    tx_desc[desc_idx].control = payload_len - 1;
-    tx_desc[desc_idx].control |= (1 << 30); /* set the LAST bit. */
+    for (i = 0; i < npkts; i++) {
+        struct packet_t *pkt = pkts[i];
+        int f;
+
+        if (tx_free_descs() - used < tx_pkt_descs(pkt))
+            break;
+
+        /* Gather the frame from the head buffer, holding the headers,
+         * and then each chained buffer in turn. */
+        tx_set_desc(desc_idx, pkt->cur_data, pkt->cur_data_length);
+
+        for (f = 0; f < pkt->nr_frags; f++) {
+            desc_idx = (desc_idx + 1) % DESC_LEN;
+            tx_set_desc(desc_idx, pkt->frags[f].data, pkt->frags[f].length);
+        }
 
-    /* Increment the TX produce index. */
-    LPC_EMAC->TxProduceIndex = (desc_idx + 1) % DESC_LEN;
+        tx_desc[desc_idx].control |= (1 << 30); /* set the LAST bit. */
+        tx_desc[desc_idx].control |= (1 << 31); /* interrupt when sent. */
 
-    /* Wait for xmit to complete. */
-    while (LPC_EMAC->TxProduceIndex != LPC_EMAC->TxConsumeIndex) {};
+        tx_pkts[desc_idx] = pkt;
+        desc_idx = (desc_idx + 1) % DESC_LEN;
+        used += tx_pkt_descs(pkt);
+    }
+
+    /* Hand the whole batch to the hardware at once.  The packets are
+     * now owned by the hardware until they are destroyed by
+     * tx_reclaim(). */
+    LPC_EMAC->TxProduceIndex = desc_idx;
+    irq_enable(flags);
+
+    return i;
+}
+
+void emac_xmit_frame(struct packet_t *pkt)
+{
+    emac_xmit_frames(&pkt, 1);
 }
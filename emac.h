@@ -1,8 +1,90 @@
 #pragma once
+#include "ethernet.h"
 
 /* Set by ether_init(). */
 extern uint8_t ether_addr[ETHER_ADDR_LEN];
 
-/* Transmit a frame over the network. */
-void emac_xmit_frame(ethernet_header *header,
-                     void *payload, int payload_len);
+/* The most frames the TX ring can hold at once, if each is held in a
+ * single buffer.  Frames with chained buffers take a descriptor per
+ * buffer. */
+#define EMAC_TX_MAX_FRAMES 11
+
+struct packet_t;
+
+/* Queue the frame held in `pkt' for transmission over the network.
+ * Returns as soon as the frame has been posted to the TX ring,
+ * blocking only while the ring is full.  While the link is down, the
+ * frame is dropped.  The frame is gathered straight from the packet's
+ * head buffer and any buffers chained to it, which must all be in
+ * memory the EMAC can reach, and the packet is destroyed, from the
+ * EMAC tasklet, once the hardware has finished with it. */
+void emac_xmit_frame(struct packet_t *pkt);
+
+/* Queue up to `npkts' frames for transmission in consecutive TX
+ * descriptors, starting them all with a single update of the produce
+ * index so they go out back to back.  Blocks only until there is room
+ * for the first frame.
+ *
+ * @returns the number of frames queued, which may be fewer than
+ * `npkts' if the ring filled up. */
+int emac_xmit_frames(struct packet_t **pkts, int npkts);
+
+/* Start accepting frames sent to the multicast address `addr'.  The
+ * hardware hash filter is imperfect, so frames for other groups that
+ * share a hash bucket with `addr' may also get through. */
+void emac_mcast_add(const uint8_t *addr);
+
+/* Stop accepting frames for a group added with emac_mcast_add(). */
+void emac_mcast_del(const uint8_t *addr);
+
+struct emac_link_stats
+{
+    uint32_t up_events;
+    uint32_t down_events;
+
+    /* Speed or duplex renegotiated while the link stayed up. */
+    uint32_t changes;
+
+    /* Frames dropped because the link was down. */
+    uint32_t tx_flushed;
+};
+
+extern struct emac_link_stats emac_link_stats;
+
+/* @returns 1 if the PHY reports an established link, 0 otherwise. */
+int emac_link_is_up(void);
+
+/* Driver error counters, to tell losses on the wire from a ring that
+ * is too small or a CPU that can't keep up. */
+struct emac_err_stats
+{
+    /* Dropped received frames, by cause. */
+    uint32_t rx_error;
+    uint32_t rx_crc;
+    uint32_t rx_symbol;
+    uint32_t rx_length;
+    uint32_t rx_alignment;
+    uint32_t rx_overrun;
+    uint32_t rx_no_desc;
+    uint32_t rx_oversize;
+
+    /* Received frames dropped for want of a packet or a buffer to
+     * refill the ring with. */
+    uint32_t rx_no_mem;
+
+    /* Failed transmissions, by cause. */
+    uint32_t tx_error;
+    uint32_t tx_late_collision;
+    uint32_t tx_excessive_collision;
+    uint32_t tx_excessive_defer;
+    uint32_t tx_underrun;
+
+    /* Error interrupts and the datapath resets they caused. */
+    uint32_t rx_overrun_irqs;
+    uint32_t tx_underrun_irqs;
+    uint32_t tx_error_irqs;
+    uint32_t rx_resets;
+    uint32_t tx_resets;
+};
+
+extern struct emac_err_stats emac_err_stats;
@@ -1,3 +1,6 @@
 #pragma once
 
 #define EINUSE 1
+#define ENOMEM 2
+#define EAGAIN 3
+#define ETIMEDOUT 4
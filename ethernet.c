@@ -1,57 +1,27 @@
 #include "lpc17xx.h"
 #include "arp.h"
-#include "memory.h"
 #include "byteswap.h"
 #include "emac.h"
 #include "ipv4.h"
 #include "list.h"
 #include "irq.h"
-#include "tick.h"
 #include "init.h"
 #include "process.h"
 #include "protocol.h"
-#include "wait.h"
+#include "msgq.h"
 #include <string.h>
 
-struct ether_tx_q_t
-{
-    uint8_t dhost[ETHER_ADDR_LEN];
-    uint16_t ether_type;
-    void *payload;
-    uint16_t payload_len;
-    list next;
-};
+/* Frames waiting for ether_tx_task().  Senders block while it is
+ * full. */
+#define ETHER_TX_Q_LEN 16
 
-static LIST(ether_tx_queue);
-static WAITQUEUE(ether_tx_waitq);
+static MSGQ(ether_tx_queue, ETHER_TX_Q_LEN);
 
 void ether_tx(uint8_t dhost[ETHER_ADDR_LEN], uint16_t ether_type,
-              void *payload, int len)
-{
-    struct ether_tx_q_t *newPacket = get_mem(sizeof(*newPacket));
-    void *payload_copy = get_mem(len);
-    irq_flags_t flags;
-
-    memcpy(payload_copy, payload, len);
-
-    ethernet_mac_copy(newPacket->dhost, dhost);
-    newPacket->ether_type = ether_type;
-    newPacket->payload = payload_copy;
-    newPacket->payload_len = len;
-
-    flags = irq_disable();
-    list_add(&newPacket->next, &ether_tx_queue);
-    irq_enable(flags);
-
-    waitqueue_wakeup(&ether_tx_waitq);
-}
-
-
-static void ether_xmit_payload(uint8_t dhost[ETHER_ADDR_LEN],
-                               uint16_t ether_type, void *payload, int len)
+              struct packet_t *pkt)
 {
+    ethernet_header *header = packet_push(pkt, sizeof(*header));
     int i;
-    ethernet_header *header = (ethernet_header *)get_mem(sizeof(ethernet_header));
 
     for (i = 0; i < ETHER_ADDR_LEN; i++) {
         header->ether_dhost[i] = dhost[i];
@@ -61,9 +31,7 @@ static void ether_xmit_payload(uint8_t dhost[ETHER_ADDR_LEN],
     header->ether_type = ether_type;
     swap_endian16(&header->ether_type);
 
-    emac_xmit_frame(header, payload, len);
-
-    free_mem(header);
+    msgq_send(&ether_tx_queue, pkt, MSGQ_FOREVER);
 }
 
 int ethernet_mac_equal(uint8_t *a, uint8_t *b)
@@ -118,23 +86,22 @@ initcall(ethernet_init);
 static void ether_tx_task(void)
 {
     while (1) {
-        struct ether_tx_q_t *txd_pkt;
-        irq_flags_t flags;
-
-        wait_for_volatile_condition((!list_empty(&ether_tx_queue)),
-                                    ether_tx_waitq);
-
-        flags = irq_disable();
-        list_pop(txd_pkt, &ether_tx_queue, next);
-        irq_enable(flags);
-
-        if (txd_pkt) {
-            ether_xmit_payload(txd_pkt->dhost, txd_pkt->ether_type,
-                               txd_pkt->payload, txd_pkt->payload_len);
-
-            free_mem(txd_pkt->payload);
-            free_mem(txd_pkt);
-        }
+        struct packet_t *batch[EMAC_TX_MAX_FRAMES];
+        void *txd_pkt;
+        int nframes = 0, sent = 0;
+
+        msgq_recv(&ether_tx_queue, &txd_pkt, MSGQ_FOREVER);
+        batch[nframes++] = txd_pkt;
+
+        /* Take as many queued frames as the TX ring can hold, so that
+         * a burst is handed to the EMAC in one go. */
+        while (nframes < EMAC_TX_MAX_FRAMES &&
+               !msgq_recv(&ether_tx_queue, &txd_pkt, 0))
+            batch[nframes++] = txd_pkt;
+
+        /* The EMAC destroys the packets once they have been sent. */
+        while (sent < nframes)
+            sent += emac_xmit_frames(batch + sent, nframes - sent);
     }
 }
-thread(ether_tx_task);
+thread_prio(ether_tx_task, PROCESS_PRIO_NET_TX);
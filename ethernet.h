@@ -17,9 +17,12 @@ typedef struct
 #define	ETHERTYPE_IP		0x0800
 #define ETHERTYPE_ARP		0x0806
 
-/* Construct an ethernet header and xmit the payload. */
+struct packet_t;
+
+/* Prepend an ethernet header to `pkt' and queue it for transmission.
+ * The packet is destroyed once it has been sent. */
 void ether_tx(uint8_t dhost[ETHER_ADDR_LEN], uint16_t ether_type,
-              void *payload, int len);
+              struct packet_t *pkt);
 
 void ether_rx_frame(void *frame, int frame_len);
 
@@ -0,0 +1,68 @@
+#include "event.h"
+#include "irq.h"
+
+void event_flags_set(struct event_flags *ev, uint32_t flags)
+{
+    irq_flags_t irq_flags = irq_disable();
+
+    ev->flags |= flags;
+    waitqueue_wakeup(&ev->waitq);
+
+    irq_enable(irq_flags);
+}
+
+/* Should be called with interrupts disabled. */
+static uint32_t event_flags_take(struct event_flags *ev, uint32_t flags)
+{
+    uint32_t set = ev->flags & flags;
+
+    ev->flags &= ~set;
+
+    return set;
+}
+
+uint32_t event_flags_wait(struct event_flags *ev, uint32_t flags)
+{
+    uint32_t set;
+    irq_flags_t irq_flags;
+
+    /* Loop, as another waiter may take the flags we were woken for
+     * before we get to run. */
+    do {
+        wait_for_volatile_condition(ev->flags & flags, ev->waitq);
+
+        irq_flags = irq_disable();
+        set = event_flags_take(ev, flags);
+        irq_enable(irq_flags);
+    } while (!set);
+
+    return set;
+}
+
+uint32_t event_flags_wait_timeout(struct event_flags *ev, uint32_t flags,
+                                  uint32_t ticks)
+{
+    uint32_t deadline = timer_ticks + ticks;
+    uint32_t set, left;
+    irq_flags_t irq_flags;
+
+    /* As in event_flags_wait(), but the wait is bounded by
+     * `deadline' rather than restarted each time round. */
+    for (;;) {
+        irq_flags = irq_disable();
+        set = event_flags_take(ev, flags);
+        irq_enable(irq_flags);
+
+        if (set)
+            break;
+
+        left = timer_ticks_left(deadline);
+
+        if (!left ||
+            wait_for_volatile_condition_timeout(ev->flags & flags,
+                                                ev->waitq, left))
+            return 0;
+    }
+
+    return set;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+#include "wait.h"
+
+/*
+ * Event flags.
+ *
+ * A group of up to 32 flags that threads can wait on.  Setting flags
+ * never blocks, so interrupt handlers can signal threads with them.
+ */
+
+struct event_flags
+{
+    volatile uint32_t flags;
+    waitqueue_t waitq;
+};
+
+#define EVENT_FLAGS(name) \
+    struct event_flags name = { .waitq = __LIST_INIT(name.waitq) }
+
+/* Set `flags' and wake the threads waiting on them.  Safe to call
+ * from an interrupt handler. */
+void event_flags_set(struct event_flags *ev, uint32_t flags);
+
+/* Wait until any of `flags' are set, then clear them.
+ *
+ * @returns the flags of `flags' that were set. */
+uint32_t event_flags_wait(struct event_flags *ev, uint32_t flags);
+
+/* As event_flags_wait(), but give up after `ticks' ticks.
+ *
+ * @returns the flags of `flags' that were set, 0 on timeout. */
+uint32_t event_flags_wait_timeout(struct event_flags *ev, uint32_t flags,
+                                  uint32_t ticks);
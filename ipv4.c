@@ -4,25 +4,17 @@
 #include "ethernet.h"
 #include "init.h"
 #include "protocol.h"
-#include "memory.h"
 #include "process.h"
 #include "irq.h"
-#include "wait.h"
+#include "msgq.h"
 #include <string.h>
 
 #define DEFAULT_TTL 10
 
-typedef struct
-{
-    uint8_t protocol;
-    uint32_t dst_ip;
-    void *payload;
-    uint16_t payload_len;
-    list next;
-} ip4_tx_q_t;
+/* Packets waiting for ip4_tx_task(). */
+#define IP4_TX_Q_LEN 16
 
-static LIST(ip4_tx_queue);
-static WAITQUEUE(ip4_tx_waitq);
+static MSGQ(ip4_tx_queue, IP4_TX_Q_LEN);
 
 static void ip4_swap_endian(ip4_header *iphdr)
 {
@@ -90,25 +82,17 @@ static void ipv4_rx_packet(struct packet_t *pkt)
     }
 }
 
-void ip4_xmit_packet(uint8_t protocol, uint32_t dst_ip, void *payload,
-                     uint16_t payload_len)
+void ip4_xmit_packet(uint8_t protocol, uint32_t dst_ip,
+                     struct packet_t *pkt)
 {
-    ip4_tx_q_t *new_packet = get_mem(sizeof(*new_packet));
-    void *payload_copy = get_mem(payload_len);
-    irq_flags_t flags;
-
-    memcpy(payload_copy, payload, payload_len);
-
-    new_packet->protocol = protocol;
-    new_packet->dst_ip = dst_ip;
-    new_packet->payload = payload_copy;
-    new_packet->payload_len = payload_len;
-
-    flags = irq_disable();
-    list_add(&new_packet->next, &ip4_tx_queue);
-    irq_enable(flags);
-
-    waitqueue_wakeup(&ip4_tx_waitq);
+    pkt->ip4_info.protocol = protocol;
+    pkt->ip4_info.dst_ip = dst_ip;
+
+    /* Wait for room rather than drop, as TCP has no retransmission
+     * to recover a dropped segment.  Should the rx task end up
+     * waiting here while ip4_tx_task() waits on it for an ARP reply,
+     * the ARP timeout breaks the tie. */
+    msgq_send(&ip4_tx_queue, pkt, MSGQ_FOREVER);
 }
 
 static uint32_t ip4_get_pkt_dst(uint32_t dst_ip)
@@ -119,66 +103,45 @@ static uint32_t ip4_get_pkt_dst(uint32_t dst_ip)
     return IP_GATEWAY;
 }
 
-static void ip4_do_xmit_packet(uint8_t protocol, uint32_t dst_ip, void *payload,
-                               uint16_t payload_len)
+static void ip4_do_xmit_packet(struct packet_t *pkt)
 {
-    void *packet_buf;
-    int packet_buf_len = sizeof(ip4_header) + payload_len;
     ip4_header *header;
-    uint32_t pkt_dst_ip = ip4_get_pkt_dst(dst_ip);
+    uint32_t pkt_dst_ip = ip4_get_pkt_dst(pkt->ip4_info.dst_ip);
     uint8_t *dst_hw_addr = resolve_address(pkt_dst_ip);
 
-    if (!dst_hw_addr)
+    if (!dst_hw_addr) {
+        packet_destroy(pkt);
         return;
+    }
 
-    packet_buf = get_mem(packet_buf_len);
-    memset(packet_buf, 0, packet_buf_len);
-
-    header = (ip4_header *)packet_buf;
+    header = packet_push(pkt, sizeof(*header));
+    memset(header, 0, sizeof(*header));
 
     header->version = 4;
     header->ihl = 5;
-    header->tot_length = packet_buf_len;
+    header->tot_length = packet_len(pkt);
     header->ttl = DEFAULT_TTL;
-    header->protocol = protocol;
+    header->protocol = pkt->ip4_info.protocol;
     header->src_ip = OUR_IP_ADDRESS;
-    header->dst_ip = dst_ip;
+    header->dst_ip = pkt->ip4_info.dst_ip;
 
     ip4_swap_endian(header);
 
     ip4_compute_checksum(header);
 
-    memcpy(packet_buf + sizeof(*header), payload, payload_len);
-
-    ether_tx(dst_hw_addr, ETHERTYPE_IP, packet_buf,
-                       packet_buf_len);
-
-    free_mem(packet_buf);
+    ether_tx(dst_hw_addr, ETHERTYPE_IP, pkt);
 }
 
 static void ip4_tx_task(void)
 {
     while (1) {
-        ip4_tx_q_t *tx_pkt;
-        irq_flags_t flags;
-
-        wait_for_volatile_condition((!list_empty(&ip4_tx_queue)),
-                                    ip4_tx_waitq);
-
-        flags = irq_disable();
-        list_pop(tx_pkt, &ip4_tx_queue, next);
-        irq_enable(flags);
-
-        if (tx_pkt) {
-            ip4_do_xmit_packet(tx_pkt->protocol, tx_pkt->dst_ip,
-                               tx_pkt->payload,  tx_pkt->payload_len);
+        void *tx_pkt;
 
-            free_mem(tx_pkt->payload);
-            free_mem(tx_pkt);
-        }
+        msgq_recv(&ip4_tx_queue, &tx_pkt, MSGQ_FOREVER);
+        ip4_do_xmit_packet(tx_pkt);
     }
 }
-thread(ip4_tx_task);
+thread_prio(ip4_tx_task, PROCESS_PRIO_NET_TX);
 
 static struct protocol_t ipv4_protocol = {
     .rx_pkt = ipv4_rx_packet,
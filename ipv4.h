@@ -20,5 +20,9 @@ typedef struct {
 
 void ip4_rx_packet(void *packet, int packet_len);
 
-void ip4_xmit_packet(uint8_t protocol, uint32_t dst_ip, void *payload,
-                     uint16_t payload_len);
+struct packet_t;
+
+/* Queue `pkt' for transmission to `dst_ip'.  An IPv4 header is put in
+ * front of the packet's data once the next hop has been resolved. */
+void ip4_xmit_packet(uint8_t protocol, uint32_t dst_ip,
+                     struct packet_t *pkt);
@@ -9,3 +9,5 @@ volatile lpc_periph_timer_t  * const LPC_TIM2   = (lpc_periph_timer_t *)0x400900
 volatile lpc_periph_timer_t  * const LPC_TIM3   = (lpc_periph_timer_t *)0x40094000;
 volatile lpc_core_nvic_t     * const LPC_NVIC   = (lpc_core_nvic_t *)0xE000E100;
 volatile lpc_core_scb_t      * const LPC_SCB    = (lpc_core_scb_t  *)0xE000ED00;
+volatile lpc_core_dwt_t      * const LPC_DWT    = (lpc_core_dwt_t *)0xE0001000;
+volatile lpc_core_debug_t    * const LPC_COREDEBUG = (lpc_core_debug_t *)0xE000EDF0;
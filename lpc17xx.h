@@ -234,8 +234,34 @@ typedef struct
     uint32_t ISAR[5];
 } lpc_core_scb_t;
 
+typedef struct
+{
+    uint32_t CTRL;
+    uint32_t CYCCNT;
+    uint32_t CPICNT;
+    uint32_t EXCCNT;
+    uint32_t SLEEPCNT;
+    uint32_t LSUCNT;
+    uint32_t FOLDCNT;
+    uint32_t PCSR;
+} lpc_core_dwt_t;
+
+typedef struct
+{
+    uint32_t DHCSR;
+    uint32_t DCRSR;
+    uint32_t DCRDR;
+    uint32_t DEMCR;
+} lpc_core_debug_t;
+
+/* Place an object in the second AHB SRAM bank, which is set aside
+ * for Ethernet DMA (see linker.ld). */
+#define __ethram __attribute__((__section__(".ethram")))
+
 #define ICSR_PENDSVSET_MASK (1 << 28)
 #define SCR_SLEEPONEXIT_MASK (1 << 1)
+#define DWT_CTRL_CYCCNTENA_MASK (1 << 0)
+#define DEMCR_TRCENA_MASK (1 << 24)
 
 extern volatile lpc_periph_emac_t   * const LPC_EMAC;
 extern volatile lpc_periph_sc_t     * const LPC_SC;
@@ -246,3 +272,5 @@ extern volatile lpc_periph_timer_t  * const LPC_TIM2;
 extern volatile lpc_periph_timer_t  * const LPC_TIM3;
 extern volatile lpc_core_nvic_t     * const LPC_NVIC;
 extern volatile lpc_core_scb_t      * const LPC_SCB;
+extern volatile lpc_core_dwt_t      * const LPC_DWT;
+extern volatile lpc_core_debug_t    * const LPC_COREDEBUG;
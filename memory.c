@@ -28,9 +28,14 @@
  *  - Volume 1 - Fundamental Algorithms
  *    - Chapter 2 – Information Structures
  *      - 2.5 Dynamic Storage
- *        - Algorithm A (First-fit method)
  *        - Algorithm C (Liberation with boundary tags)
  *
+ * Free blocks are kept in segregated free lists, indexed with the two-level
+ * scheme described in "TLSF: a New Dynamic Memory Allocator for Real-Time
+ * Systems" by M. Masmano, I. Ripoll, A. Crespo and J. Real. This makes both
+ * allocation and liberation complete in bounded time, independently of the
+ * number of free blocks.
+ *
  * The point of a memory allocator is to manage memory in terms of allocation
  * and liberation requests. Allocation finds and reserves memory for a user,
  * whereas liberation makes that memory available again for future allocations.
@@ -100,6 +105,27 @@
  * the block. But without a footer boundary tag, finding the address of
  * the previous block is computationally expensive.
  *
+ * Segregated free lists
+ * ---------------------
+ * Each free block is on one of several free lists, chosen by its size. The
+ * first level index is the position of the most significant bit of the
+ * size, i.e. the power of two range the size falls into. Each of these
+ * ranges is further split into MEM_SL_COUNT equal parts, the second level
+ * index being made of the bits following the most significant one. For
+ * example, with 4 second level lists, blocks of 64 to 79 bytes go on list
+ * (6, 0), and blocks of 80 to 95 bytes on list (6, 1).
+ *
+ * A bitmap per level records which lists are non-empty. To allocate, the
+ * requested size is rounded up to the start of the next list range, so
+ * that any block on the list it maps to, or on a later one, is large
+ * enough. Finding the first non-empty list at or after that one is then a
+ * matter of masking the bitmaps and counting trailing zeroes, which the
+ * processor does in a few instructions, instead of walking a list.
+ *
+ * Building with -DMEM_FIRST_FIT brings back the single first-fit free list
+ * this allocator used to have, as a baseline to measure it against. See
+ * the mem-bench target of the Makefile.
+ *
  * Alignment
  * ---------
  * The word "aligned" and references to "alignment" in general can be
@@ -132,17 +158,10 @@
 #include "memory.h"
 #include "irq.h"
 /*
- * Total size of the backing storage heap.
- *
- * Note that the resulting kernel image file remains much smaller than this.
- * The reason is because the heap is defined as uninitialized data, which are
- * allocated out of the bss section by default. The bss section is filled
- * with zeroes when the kernel image is loaded by the boot loader, as
- * mandated by the ELF specification, which means there is no need to store
- * the heap data, or any other statically allocated uninitialized data, in
- * the kernel image file.
+ * Size up to which a request without a placement hint is considered small,
+ * and served from the local SRAM bank.
  */
-#define MEM_HEAP_SIZE       (32 * 1024)
+#define MEM_SMALL_SIZE      256
 
 /*
  * Alignment required on addresses returned by mem_alloc().
@@ -160,20 +179,34 @@
                                     + sizeof(struct mem_free_node)), MEM_ALIGN)
 
 /*
- * The heap itself must be aligned, so that the first block is also aligned.
- * Assuming all blocks have an aligned size, the last block must also end on
- * an aligned address.
+ * Number of second level free lists per first level, as a power of two.
  *
- * This kind of check increases safety and robustness when changing
- * compile-time parameters such as the heap size declared above.
+ * More lists mean less memory is lost rounding requests up, at the cost of
+ * a larger free list array.
+ */
+#define MEM_SL_SHIFT        2
+#define MEM_SL_COUNT        (1 << MEM_SL_SHIFT)
+
+/*
+ * Range of first level indexes.
  *
- * Another relevant check would be to make sure the heap is large enough
- * to contain at least one block, but since the minimum block size is
- * defined using the C sizeof operator, unknown to the C preprocessor,
- * this check requires C11 static assertions.
+ * The smallest block is 16 bytes, i.e. two boundary tags and a free list
+ * node of two pointers, and the largest one is a whole region. Block sizes
+ * at the low end are multiples of MEM_ALIGN, which must not be finer than
+ * the second level split of the smallest range.
  */
-#if !P2ALIGNED(MEM_HEAP_SIZE, MEM_ALIGN)
-#error "invalid heap size"
+#define MEM_FL_MIN          4
+#define MEM_FL_MAX          15
+#define MEM_FL_COUNT        (MEM_FL_MAX - MEM_FL_MIN + 1)
+
+/*
+ * Largest block size the free lists can index. Regions larger than this
+ * are truncated.
+ */
+#define MEM_REGION_MAX_SIZE ((1 << (MEM_FL_MAX + 1)) - MEM_ALIGN)
+
+#if (1 << (MEM_FL_MIN - MEM_SL_SHIFT)) < MEM_ALIGN
+#error "second level lists too fine for the block alignment"
 #endif
 
 /*
@@ -219,39 +252,66 @@ struct mem_free_node {
 };
 
 /*
- * List of free nodes.
+ * Segregated lists of free nodes.
+ *
+ * Bit i of fl_bitmap is set when any of the lists of first level i is
+ * non-empty, and bit j of sl_bitmaps[i] when list (i, j) is.
  *
  * Here is an example of a TODO entry, a method used to store and retrieve
  * pending tasks using source code only :
  *
  * TODO Statistics counters.
  */
+#ifndef MEM_FIRST_FIT
+struct mem_free_list {
+    unsigned int fl_bitmap;
+    unsigned int sl_bitmaps[MEM_FL_COUNT];
+    struct list free_nodes[MEM_FL_COUNT][MEM_SL_COUNT];
+};
+#else /* MEM_FIRST_FIT */
 struct mem_free_list {
     struct list free_nodes;
 };
+#endif /* MEM_FIRST_FIT */
 
 /*
- * Memory heap.
+ * Memory region.
  *
- * This allocator uses a single heap initialized with a single large free
- * block. The allocator could be extended to support multiple heaps, each
- * initialized with a single free block, forming an initial free list of
- * more than one block.
+ * The heap is made of several disjoint regions, one per SRAM bank, each
+ * covering whatever the linker left free in its bank. A region is
+ * initialized with a single large free block, and has free lists of its
+ * own. Blocks never cross region boundaries, so a block is only ever
+ * merged with neighbors from the same region.
  *
- * The heap must be correctly aligned, so that the first block is
+ * Regions are aligned when initialized, so that their first block is
  * correctly aligned.
  */
-static char mem_heap[MEM_HEAP_SIZE] __aligned(MEM_ALIGN)
-    __attribute__((__section__(".heap")));
+struct mem_region {
+    char *start;
+    char *end;
+    struct mem_free_list free_list;
+};
 
 /*
- * The unique free list.
+ * Regions, in the order they are tried for requests without a placement
+ * hint.
  *
- * In order to improve allocation speed, multiple lists may be used, each
- * for a specific size range. Such lists are called segregated free lists
- * and enable more allocation policies, such as instant-fit.
+ * The local bank sits on the processor's own bus and is the fastest, but
+ * the AHB masters, in particular the Ethernet DMA, can't reach it.
  */
-static struct mem_free_list mem_free_list;
+enum mem_region_id {
+    MEM_REGION_LOCAL,
+    MEM_REGION_AHB,
+    MEM_NR_REGIONS
+};
+
+static struct mem_region mem_regions[MEM_NR_REGIONS];
+
+/*
+ * Region bounds, exported by the linker script.
+ */
+extern char _sheap_ram1[], _eheap_ram1[];
+extern char _sheap_ram2[], _eheap_ram2[];
 
 static bool
 mem_aligned(size_t value)
@@ -259,12 +319,6 @@ mem_aligned(size_t value)
     return P2ALIGNED(value, MEM_ALIGN);
 }
 
-static void *
-mem_heap_end(void)
-{
-    return &mem_heap[sizeof(mem_heap)];
-}
-
 static bool
 mem_btag_allocated(const struct mem_btag *btag)
 {
@@ -381,11 +435,11 @@ mem_block_footer_btag(struct mem_block *block)
 }
 
 static struct mem_block *
-mem_block_prev(struct mem_block *block)
+mem_block_prev(struct mem_region *region, struct mem_block *block)
 {
     struct mem_btag *btag;
 
-    if ((char *)block == mem_heap) {
+    if ((char *)block == region->start) {
         return NULL;
     }
 
@@ -394,11 +448,11 @@ mem_block_prev(struct mem_block *block)
 }
 
 static struct mem_block *
-mem_block_next(struct mem_block *block)
+mem_block_next(struct mem_region *region, struct mem_block *block)
 {
     block = mem_block_end(block);
 
-    if ((void *)block == mem_heap_end()) {
+    if ((char *)block == region->end) {
         return NULL;
     }
 
@@ -446,37 +500,185 @@ mem_block_get_free_node(struct mem_block *block)
 }
 
 static bool
-mem_block_inside_heap(const struct mem_block *block)
+mem_block_inside_region(const struct mem_region *region,
+                        const struct mem_block *block)
 {
-    void *heap_end;
+    return (((char *)block >= region->start)
+            && ((char *)block->payload < region->end)
+            && ((char *)mem_block_end(block) <= region->end));
+}
 
-    heap_end = mem_heap_end();
-    return (((char *)block >= mem_heap)
-            && ((void *)block->payload < heap_end)
-            && ((void *)mem_block_end(block) <= heap_end));
+/*
+ * Return the region a block belongs to.
+ */
+static struct mem_region *
+mem_block_region(const struct mem_block *block)
+{
+    struct mem_region *region;
+
+    for (region = mem_regions;
+         region < &mem_regions[MEM_NR_REGIONS];
+         region++) {
+        if (((char *)block >= region->start)
+            && ((char *)block < region->end)) {
+            return region;
+        }
+    }
+
+    return NULL;
+}
+
+#ifndef MEM_FIRST_FIT
+
+/*
+ * Return the position of the most significant bit set in a non-zero value.
+ *
+ * The compiler turns this into a single CLZ instruction.
+ */
+static unsigned int
+mem_msb(size_t value)
+{
+    return (sizeof(unsigned int) * 8) - 1 - __builtin_clz(value);
+}
+
+/*
+ * Compute the indexes of the free list blocks of the given size go on.
+ *
+ * The first level index is returned relative to MEM_FL_MIN.
+ */
+static void
+mem_free_list_index(size_t size, unsigned int *fl, unsigned int *sl)
+{
+    unsigned int msb;
+
+    assert(size >= (1 << MEM_FL_MIN));
+
+    msb = mem_msb(size);
+    *fl = msb - MEM_FL_MIN;
+    *sl = (size >> (msb - MEM_SL_SHIFT)) & (MEM_SL_COUNT - 1);
 }
 
 static void
 mem_free_list_add(struct mem_free_list *list, struct mem_block *block)
 {
     struct mem_free_node *free_node;
+    unsigned int fl, sl;
 
     assert(mem_block_allocated(block));
 
     mem_block_clear_allocated(block);
     free_node = mem_block_get_free_node(block);
+    mem_free_list_index(mem_block_size(block), &fl, &sl);
 
     /*
      * Free blocks may be added at either the head or the tail of a list.
-     * In this case, it's normally better to add at the head, because the
-     * first-fit algorithm implementation starts from the beginning. This
-     * means there is a good chance that a block recently freed may "soon"
-     * be allocated again. Since it's likely that this block was accessed
-     * before it was freed, there is a good chance that (part of) its memory
-     * is still in the processor cache, potentially increasing the chances
-     * of cache hits and saving a few expensive accesses from the processor
-     * to memory. This is an example of inexpensive micro-optimization.
+     * In this case, it's normally better to add at the head, because
+     * allocation takes the first block of a list. This means there is a
+     * good chance that a block recently freed may "soon" be allocated again.
+     * Since it's likely that this block was accessed before it was freed,
+     * there is a good chance that (part of) its memory is still in the
+     * processor cache, potentially increasing the chances of cache hits and
+     * saving a few expensive accesses from the processor to memory. This is
+     * an example of inexpensive micro-optimization.
      */
+    list_add(&free_node->node, &list->free_nodes[fl][sl]);
+    list->sl_bitmaps[fl] |= (1U << sl);
+    list->fl_bitmap |= (1U << fl);
+}
+
+static void
+mem_free_list_remove(struct mem_free_list *list, struct mem_block *block)
+{
+    struct mem_free_node *free_node;
+    unsigned int fl, sl;
+
+    assert(!mem_block_allocated(block));
+
+    free_node = mem_block_get_free_node(block);
+    list_del(&free_node->node);
+    mem_block_set_allocated(block);
+
+    mem_free_list_index(mem_block_size(block), &fl, &sl);
+
+    if (list_empty(&list->free_nodes[fl][sl])) {
+        list->sl_bitmaps[fl] &= ~(1U << sl);
+
+        if (list->sl_bitmaps[fl] == 0) {
+            list->fl_bitmap &= ~(1U << fl);
+        }
+    }
+}
+
+static struct mem_block *
+mem_free_list_find(struct mem_free_list *list, size_t size)
+{
+    struct list *free_nodes;
+    unsigned int fl, sl, bitmap;
+
+    /*
+     * Round the size up to the start of the next second level range, so
+     * that the first block of whichever list is found is large enough.
+     * Taking a block from the exact list instead would require walking it,
+     * which is precisely what this allocator avoids. The algorithmic
+     * complexity of this operation is O(1) [1], which basically means the
+     * maximum number of steps, and time, for the operation to complete
+     * doesn't depend on the number of free blocks.
+     *
+     * [1] https://en.wikipedia.org/wiki/Big_O_notation
+     */
+    size += (1 << (mem_msb(size) - MEM_SL_SHIFT)) - 1;
+    mem_free_list_index(size, &fl, &sl);
+
+    if (fl >= MEM_FL_COUNT) {
+        return NULL;
+    }
+
+    bitmap = list->sl_bitmaps[fl] & (~0U << sl);
+
+    if (bitmap == 0) {
+        bitmap = list->fl_bitmap & (~0U << 1 << fl);
+
+        if (bitmap == 0) {
+            return NULL;
+        }
+
+        fl = __builtin_ctz(bitmap);
+        bitmap = list->sl_bitmaps[fl];
+    }
+
+    sl = __builtin_ctz(bitmap);
+    free_nodes = &list->free_nodes[fl][sl];
+    return mem_block_from_payload(list_entry(free_nodes->next,
+                                             struct mem_free_node, node));
+}
+
+static void
+mem_free_list_init(struct mem_free_list *list)
+{
+    unsigned int fl, sl;
+
+    list->fl_bitmap = 0;
+
+    for (fl = 0; fl < MEM_FL_COUNT; fl++) {
+        list->sl_bitmaps[fl] = 0;
+
+        for (sl = 0; sl < MEM_SL_COUNT; sl++) {
+            INIT_LIST(&list->free_nodes[fl][sl]);
+        }
+    }
+}
+
+#else /* MEM_FIRST_FIT */
+
+static void
+mem_free_list_add(struct mem_free_list *list, struct mem_block *block)
+{
+    struct mem_free_node *free_node;
+
+    assert(mem_block_allocated(block));
+
+    mem_block_clear_allocated(block);
+    free_node = mem_block_get_free_node(block);
     list_add(&free_node->node, &list->free_nodes);
 }
 
@@ -494,23 +696,16 @@ mem_free_list_remove(struct mem_free_list *list, struct mem_block *block)
     mem_block_set_allocated(block);
 }
 
+/*
+ * Walk the list until a block is large enough. This takes O(n) steps, n
+ * being the number of free blocks.
+ */
 static struct mem_block *
 mem_free_list_find(struct mem_free_list *list, size_t size)
 {
     struct mem_free_node *free_node;
     struct mem_block *block;
 
-    /*
-     * The algorithmic complexity of this operation is O(n) [1] which
-     * basically means the maximum number of steps, and time, for the
-     * operation to complete depend on the number of elements in the list.
-     * This is one of the main reasons why memory allocation is generally
-     * avoided in interrupt handlers and real-time applications. Special
-     * allocators with guaranteed constant time or a fixed and known worst
-     * case time, may be used in these cases.
-     *
-     * [1] https://en.wikipedia.org/wiki/Big_O_notation
-     */
     list_for_each(free_node, &list->free_nodes, node) {
         block = mem_block_from_payload(free_node);
 
@@ -528,6 +723,135 @@ mem_free_list_init(struct mem_free_list *list)
     INIT_LIST(&list->free_nodes);
 }
 
+#endif /* MEM_FIRST_FIT */
+
+#ifdef MEM_STATS
+
+struct mem_stats mem_stats;
+
+/*
+ * Return the word holding the index of the call site that allocated a
+ * block.
+ *
+ * When statistics are enabled, every allocation request is grown by one
+ * word, and that word is taken from the end of the payload, where the
+ * user never accesses it.
+ */
+static uint32_t *
+mem_block_site(struct mem_block *block)
+{
+    return (uint32_t *)mem_block_footer_btag(block) - 1;
+}
+
+static unsigned int
+mem_stats_site_index(void *caller)
+{
+    unsigned int i;
+
+    for (i = 0; i < (MEM_STATS_NR_SITES - 1); i++) {
+        if (mem_stats.sites[i].caller == caller) {
+            return i;
+        }
+
+        if (mem_stats.sites[i].caller == NULL) {
+            mem_stats.sites[i].caller = caller;
+            return i;
+        }
+    }
+
+    return MEM_STATS_NR_SITES - 1;
+}
+
+static void
+mem_stats_account_alloc(struct mem_block *block, void *caller)
+{
+    struct mem_site_stats *site;
+    unsigned int index;
+    size_t size;
+
+    size = mem_block_size(block);
+    index = mem_stats_site_index(caller);
+    *mem_block_site(block) = index;
+
+    mem_stats.allocs++;
+    mem_stats.used += size;
+
+    if (mem_stats.used > mem_stats.peak) {
+        mem_stats.peak = mem_stats.used;
+    }
+
+    site = &mem_stats.sites[index];
+    site->allocs++;
+    site->bytes += size;
+
+    if (site->bytes > site->peak_bytes) {
+        site->peak_bytes = site->bytes;
+    }
+}
+
+static void
+mem_stats_account_free(struct mem_block *block)
+{
+    struct mem_site_stats *site;
+    size_t size;
+
+    size = mem_block_size(block);
+    site = &mem_stats.sites[*mem_block_site(block)];
+
+    mem_stats.frees++;
+    mem_stats.used -= size;
+    site->frees++;
+    site->bytes -= size;
+}
+
+void
+mem_get_free_info(struct mem_free_info *info)
+{
+    struct mem_region *region;
+    struct mem_block *block;
+    unsigned int i;
+    irq_flags_t flags;
+
+    info->free = 0;
+    info->largest_free = 0;
+    info->nr_free_blocks = 0;
+
+    flags = irq_disable();
+
+    /*
+     * Walk the blocks themselves rather than the free lists, so that this
+     * doesn't depend on how the free lists are organized.
+     */
+    for (i = 0; i < MEM_NR_REGIONS; i++) {
+        region = &mem_regions[i];
+
+        for (block = (struct mem_block *)region->start;
+             (char *)block < region->end;
+             block = mem_block_end(block)) {
+            if (mem_block_allocated(block)) {
+                continue;
+            }
+
+            info->free += mem_block_size(block);
+            info->nr_free_blocks++;
+
+            if (mem_block_size(block) > info->largest_free) {
+                info->largest_free = mem_block_size(block);
+            }
+        }
+    }
+
+    irq_enable(flags);
+
+    if (info->free == 0) {
+        info->fragmentation = 0;
+    } else {
+        info->fragmentation = 100 - ((info->largest_free * 100) / info->free);
+    }
+}
+
+#endif /* MEM_STATS */
+
 static bool
 mem_block_inside(struct mem_block *block, void *addr)
 {
@@ -563,7 +887,8 @@ mem_block_split(struct mem_block *block, size_t size)
 }
 
 static struct mem_block *
-mem_block_merge(struct mem_block *block1, struct mem_block *block2)
+mem_block_merge(struct mem_region *region, struct mem_block *block1,
+                struct mem_block *block2)
 {
     size_t size;
 
@@ -573,8 +898,8 @@ mem_block_merge(struct mem_block *block1, struct mem_block *block2)
         return NULL;
     }
 
-    mem_free_list_remove(&mem_free_list, block1);
-    mem_free_list_remove(&mem_free_list, block2);
+    mem_free_list_remove(&region->free_list, block1);
+    mem_free_list_remove(&region->free_list, block2);
     size = mem_block_size(block1) + mem_block_size(block2);
 
     if (block1 > block2) {
@@ -582,18 +907,47 @@ mem_block_merge(struct mem_block *block1, struct mem_block *block2)
     }
 
     mem_block_init(block1, size);
-    mem_free_list_add(&mem_free_list, block1);
+    mem_free_list_add(&region->free_list, block1);
     return block1;
 }
-void
-mem_setup(void)
+
+static void
+mem_region_init(struct mem_region *region, char *start, char *end)
 {
     struct mem_block *block;
+    size_t size;
+
+    start = (char *)P2ROUND((uintptr_t)start, MEM_ALIGN);
+    end = (char *)P2ALIGN((uintptr_t)end, MEM_ALIGN);
+    mem_free_list_init(&region->free_list);
 
-    block = (struct mem_block *)mem_heap;
-    mem_block_init(block, sizeof(mem_heap));
-    mem_free_list_init(&mem_free_list);
-    mem_free_list_add(&mem_free_list, block);
+    /*
+     * A bank may have nothing left, in which case the region is left
+     * empty, and never matches any block.
+     */
+    if ((end <= start) || ((size_t)(end - start) < MEM_BLOCK_MIN_SIZE)) {
+        region->start = region->end = start;
+        return;
+    }
+
+    size = MIN((size_t)(end - start), MEM_REGION_MAX_SIZE);
+    region->start = start;
+    region->end = start + size;
+
+    block = (struct mem_block *)start;
+    mem_block_init(block, size);
+    mem_free_list_add(&region->free_list, block);
+
+#ifdef MEM_STATS
+    mem_stats.heap_size += size;
+#endif /* MEM_STATS */
+}
+
+void
+mem_setup(void)
+{
+    mem_region_init(&mem_regions[MEM_REGION_LOCAL], _sheap_ram1, _eheap_ram1);
+    mem_region_init(&mem_regions[MEM_REGION_AHB], _sheap_ram2, _eheap_ram2);
 }
 
 static size_t
@@ -614,35 +968,86 @@ mem_convert_to_block_size(size_t size)
     return size;
 }
 
-void *
-get_mem(size_t size)
+/*
+ * Allocate a block from a specific region.
+ */
+static struct mem_block *
+mem_region_alloc(struct mem_region *region, size_t size)
 {
     struct mem_block *block, *block2;
+
+    block = mem_free_list_find(&region->free_list, size);
+
+    if (block == NULL) {
+        return NULL;
+    }
+
+    mem_free_list_remove(&region->free_list, block);
+    block2 = mem_block_split(block, size);
+
+    if (block2 != NULL) {
+        mem_free_list_add(&region->free_list, block2);
+    }
+
+    return block;
+}
+
+static void *
+mem_alloc(size_t size, enum mem_hint hint, void *caller)
+{
+    enum mem_region_id first, second;
+    struct mem_block *block;
     void *ptr;
     irq_flags_t flags;
 
+    (void)caller;
+
     if (size == 0) {
         return NULL;
     }
 
+    /*
+     * Pick the region to try first, and the one to fall back on. The
+     * local bank is kept for small objects by default, as they are the
+     * ones accessed most often, leaving the AHB bank to larger buffers.
+     */
+    if (hint == MEM_HINT_ANY) {
+        hint = (size <= MEM_SMALL_SIZE) ? MEM_HINT_LOCAL : MEM_HINT_AHB;
+    }
+
+    if (hint == MEM_HINT_LOCAL) {
+        first = MEM_REGION_LOCAL;
+        second = MEM_REGION_AHB;
+    } else {
+        first = MEM_REGION_AHB;
+        second = (hint == MEM_HINT_DMA) ? MEM_REGION_AHB : MEM_REGION_LOCAL;
+    }
+
+#ifdef MEM_STATS
+    size += sizeof(uint32_t);
+#endif /* MEM_STATS */
+
     size = mem_convert_to_block_size(size);
 
     flags = irq_disable();
 
-    block = mem_free_list_find(&mem_free_list, size);
+    block = mem_region_alloc(&mem_regions[first], size);
+
+    if ((block == NULL) && (second != first)) {
+        block = mem_region_alloc(&mem_regions[second], size);
+    }
 
     if (block == NULL) {
-        __asm__("b .");
+#ifdef MEM_STATS
+        mem_stats.failures++;
+#endif /* MEM_STATS */
         irq_enable(flags);
         return NULL;
     }
 
-    mem_free_list_remove(&mem_free_list, block);
-    block2 = mem_block_split(block, size);
-
-    if (block2 != NULL) {
-        mem_free_list_add(&mem_free_list, block2);
-    }
+#ifdef MEM_STATS
+    mem_stats_account_alloc(block, caller);
+#endif /* MEM_STATS */
 
     irq_enable(flags);
 
@@ -651,10 +1056,23 @@ get_mem(size_t size)
     return ptr;
 }
 
+void *
+get_mem(size_t size)
+{
+    return mem_alloc(size, MEM_HINT_ANY, __builtin_return_address(0));
+}
+
+void *
+get_mem_hint(size_t size, enum mem_hint hint)
+{
+    return mem_alloc(size, hint, __builtin_return_address(0));
+}
+
 void
 free_mem(void *ptr)
 {
     struct mem_block *block, *tmp;
+    struct mem_region *region;
     irq_flags_t flags;
 
     if (!ptr) {
@@ -664,26 +1082,32 @@ free_mem(void *ptr)
     assert(mem_aligned((uintptr_t)ptr));
 
     block = mem_block_from_payload(ptr);
-    assert(mem_block_inside_heap(block));
+    region = mem_block_region(block);
+    assert(region != NULL);
+    assert(mem_block_inside_region(region, block));
 
     flags = irq_disable();
 
-    mem_free_list_add(&mem_free_list, block);
+#ifdef MEM_STATS
+    mem_stats_account_free(block);
+#endif /* MEM_STATS */
+
+    mem_free_list_add(&region->free_list, block);
 
-    tmp = mem_block_prev(block);
+    tmp = mem_block_prev(region, block);
 
     if (tmp) {
-        tmp = mem_block_merge(block, tmp);
+        tmp = mem_block_merge(region, block, tmp);
 
         if (tmp) {
             block = tmp;
         }
     }
 
-    tmp = mem_block_next(block);
+    tmp = mem_block_next(region, block);
 
     if (tmp) {
-        mem_block_merge(block, tmp);
+        mem_block_merge(region, block, tmp);
     }
 
     irq_enable(flags);
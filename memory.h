@@ -31,6 +31,7 @@
 #define _MEM_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 /*
  * Initialize the mem module.
@@ -45,6 +46,9 @@ void mem_setup(void);
  *  - The size argument is the allocation request size, in bytes.
  *  - An allocation size of 0 is permitted.
  *  - The content of the allocated block is uninitialized.
+ *  - NULL is returned if no free block is large enough. Callers are
+ *    expected to shed load, e.g. by dropping a frame, rather than
+ *    stopping the system.
  *  - The returned value is the address of the allocated block of memory.
  *  - The address of the allocated block is aligned to the maximum built-in
  *    type size. Since this code targets the 32-bits i386 architecture, the
@@ -79,6 +83,29 @@ void mem_setup(void);
  */
 void * get_mem(size_t size);
 
+/*
+ * Placement hints.
+ *
+ * The heap spans both SRAM banks. The local bank is on the processor's own
+ * bus, but can't be reached by the DMA masters, in particular the Ethernet
+ * DMA. Requests are served from the hinted bank if it has room, and from
+ * the other bank otherwise, except for MEM_HINT_DMA.
+ */
+enum mem_hint {
+    MEM_HINT_ANY,   /* Local bank for small requests, AHB bank otherwise */
+    MEM_HINT_LOCAL, /* Prefer the local bank, for hot objects */
+    MEM_HINT_AHB,   /* Prefer the AHB bank, for large buffers */
+    MEM_HINT_DMA,   /* AHB bank only, for memory handed to a DMA */
+};
+
+/*
+ * Allocate memory, with a placement hint.
+ *
+ * This function behaves like get_mem(), which is equivalent to passing
+ * MEM_HINT_ANY.
+ */
+void * get_mem_hint(size_t size, enum mem_hint hint);
+
 /*
  * Free memory.
  *
@@ -89,4 +116,70 @@ void * get_mem(size_t size);
  */
 void free_mem(void *ptr);
 
+#ifdef MEM_STATS
+
+/*
+ * Allocator instrumentation.
+ *
+ * Build with -DMEM_STATS to have the allocator keep track of how much of
+ * the heap is used, and by whom. This costs a word per block, used to
+ * remember the call site that allocated it, and a lookup in the call site
+ * table on each allocation.
+ */
+
+/*
+ * Number of call sites tracked individually.
+ *
+ * The last entry of the table collects the call sites that didn't fit.
+ */
+#define MEM_STATS_NR_SITES 16
+
+struct mem_site_stats {
+    void *caller;
+    uint32_t allocs;
+    uint32_t frees;
+    size_t bytes;
+    size_t peak_bytes;
+};
+
+/*
+ * Byte counts include the block overhead, i.e. they reflect how much of
+ * the heap is actually consumed.
+ */
+struct mem_stats {
+    size_t heap_size;
+    size_t used;
+    size_t peak;
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t failures;
+    struct mem_site_stats sites[MEM_STATS_NR_SITES];
+};
+
+extern struct mem_stats mem_stats;
+
+/*
+ * Snapshot of the free space, built by walking the heap.
+ *
+ * The fragmentation index is the percentage of free memory not part of
+ * the largest free block, i.e. 0 if all free memory is contiguous, and
+ * close to 100 if it is scattered into many small blocks.
+ */
+struct mem_free_info {
+    size_t free;
+    size_t largest_free;
+    unsigned int nr_free_blocks;
+    unsigned int fragmentation;
+};
+
+/*
+ * Fill in a snapshot of the free space.
+ *
+ * This function walks every block with interrupts disabled, and is
+ * meant for diagnostics, not to be called from time critical code.
+ */
+void mem_get_free_info(struct mem_free_info *info);
+
+#endif /* MEM_STATS */
+
 #endif /* _MEM_H */
@@ -0,0 +1,106 @@
+#include "msgq.h"
+#include "irq.h"
+#include "error.h"
+
+/* Should be called with interrupts disabled, with room in `q'. */
+static void msgq_put(struct msgq *q, void *msg)
+{
+    q->msgs[(q->head + q->count) % q->size] = msg;
+    q->count++;
+    waitqueue_wakeup_one(&q->recv_waitq);
+}
+
+/* Should be called with interrupts disabled, with `q' non-empty. */
+static void *msgq_get(struct msgq *q)
+{
+    void *msg = q->msgs[q->head];
+
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    waitqueue_wakeup_one(&q->send_waitq);
+
+    return msg;
+}
+
+int msgq_post(struct msgq *q, void *msg)
+{
+    irq_flags_t flags = irq_disable();
+
+    if (q->count == q->size) {
+        irq_enable(flags);
+        return -EAGAIN;
+    }
+
+    msgq_put(q, msg);
+    irq_enable(flags);
+
+    return 0;
+}
+
+int msgq_send(struct msgq *q, void *msg, uint32_t ticks)
+{
+    uint32_t deadline = timer_ticks + ticks;
+    irq_flags_t flags;
+
+    if (!ticks)
+        return msgq_post(q, msg);
+
+    /* Loop, as another sender may take the room we were woken for
+     * before we get to run.  The wait is bounded by `deadline', not
+     * restarted each time round. */
+    for (;;) {
+        if (ticks == MSGQ_FOREVER)
+            wait_for_volatile_condition(q->count < q->size,
+                                        q->send_waitq);
+        else {
+            uint32_t left = timer_ticks_left(deadline);
+
+            if (!left ||
+                wait_for_volatile_condition_timeout(q->count < q->size,
+                                                    q->send_waitq, left))
+                return -ETIMEDOUT;
+        }
+
+        flags = irq_disable();
+
+        if (q->count < q->size) {
+            msgq_put(q, msg);
+            irq_enable(flags);
+            return 0;
+        }
+
+        irq_enable(flags);
+    }
+}
+
+int msgq_recv(struct msgq *q, void **msg, uint32_t ticks)
+{
+    uint32_t deadline = timer_ticks + ticks;
+    irq_flags_t flags;
+
+    for (;;) {
+        flags = irq_disable();
+
+        if (q->count) {
+            *msg = msgq_get(q);
+            irq_enable(flags);
+            return 0;
+        }
+
+        irq_enable(flags);
+
+        if (!ticks)
+            return -EAGAIN;
+
+        if (ticks == MSGQ_FOREVER)
+            wait_for_volatile_condition(q->count, q->recv_waitq);
+        else {
+            uint32_t left = timer_ticks_left(deadline);
+
+            if (!left ||
+                wait_for_volatile_condition_timeout(q->count,
+                                                    q->recv_waitq, left))
+                return -ETIMEDOUT;
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include "wait.h"
+
+/*
+ * Message queues.
+ *
+ * A bounded FIFO of pointers handed from one thread to another, or
+ * from an interrupt handler to a thread.  Senders block while the
+ * queue is full and receivers while it is empty; each message passed
+ * wakes at most one waiter on the other side.
+ */
+
+/* Wait for as long as it takes. */
+#define MSGQ_FOREVER UINT32_MAX
+
+struct msgq
+{
+    void **msgs;
+    uint16_t size;
+    uint16_t head;
+    volatile uint16_t count;
+
+    waitqueue_t recv_waitq;
+    waitqueue_t send_waitq;
+};
+
+/* Define a message queue `name' holding up to `nr_msgs' messages. */
+#define MSGQ(name, nr_msgs)                                     \
+    struct msgq name = {                                        \
+        .msgs = (void *[nr_msgs]){ NULL },                      \
+        .size = nr_msgs,                                        \
+        .recv_waitq = __LIST_INIT(name.recv_waitq),             \
+        .send_waitq = __LIST_INIT(name.send_waitq),             \
+    }
+
+/* Queue `msg' without waiting.  Safe to call from an interrupt
+ * handler.
+ *
+ * @returns 0 on success, -EAGAIN if the queue is full. */
+int msgq_post(struct msgq *q, void *msg);
+
+/* Queue `msg', waiting up to `ticks' ticks for room.
+ *
+ * @returns 0 on success, -EAGAIN if the queue is full and `ticks' is
+ * 0, -ETIMEDOUT if it stayed full. */
+int msgq_send(struct msgq *q, void *msg, uint32_t ticks);
+
+/* Take the oldest message off the queue, waiting up to `ticks' ticks
+ * for one to arrive.
+ *
+ * @returns 0 on success, -EAGAIN if the queue is empty and `ticks' is
+ * 0, -ETIMEDOUT if it stayed empty. */
+int msgq_recv(struct msgq *q, void **msg, uint32_t ticks);
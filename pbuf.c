@@ -0,0 +1,148 @@
+#include "pbuf.h"
+#include "lpc17xx.h"
+#include "memory.h"
+#include "irq.h"
+#include "init.h"
+
+struct pbuf_free_node
+{
+    struct pbuf_free_node *next;
+};
+
+struct pbuf_pool
+{
+    uint8_t *start;
+    uint8_t *end;
+    struct pbuf_free_node *free_list;
+};
+
+static uint8_t __attribute__((aligned(4))) __ethram
+pbuf_small_mem[PBUF_SMALL_NR][PBUF_SMALL_SZ];
+
+static uint8_t __attribute__((aligned(4))) __ethram
+pbuf_mtu_mem[PBUF_MTU_NR][PBUF_MTU_SZ];
+
+static struct pbuf_pool pbuf_pools[PBUF_NR_CLASSES] = {
+    [PBUF_SMALL] = {
+        .start = &pbuf_small_mem[0][0],
+        .end = &pbuf_small_mem[PBUF_SMALL_NR][0],
+    },
+    [PBUF_MTU] = {
+        .start = &pbuf_mtu_mem[0][0],
+        .end = &pbuf_mtu_mem[PBUF_MTU_NR][0],
+    },
+};
+
+struct pbuf_stats pbuf_stats[PBUF_NR_CLASSES] = {
+    [PBUF_SMALL] = {
+        .size = PBUF_SMALL_SZ,
+        .nr = PBUF_SMALL_NR,
+    },
+    [PBUF_MTU] = {
+        .size = PBUF_MTU_SZ,
+        .nr = PBUF_MTU_NR,
+    },
+};
+
+uint32_t pbuf_heap_fallbacks;
+
+/* Buffers of each class that pbuf_alloc() leaves for pbuf_alloc_rx(). */
+static const uint16_t pbuf_rx_reserve[PBUF_NR_CLASSES] = {
+    [PBUF_MTU] = PBUF_MTU_RX_RESERVE,
+};
+
+static void pbuf_pool_push(enum pbuf_class class, void *buf)
+{
+    struct pbuf_free_node *node = buf;
+
+    node->next = pbuf_pools[class].free_list;
+    pbuf_pools[class].free_list = node;
+    pbuf_stats[class].free++;
+}
+
+/* Take a buffer from `class', leaving at least `reserve' behind. */
+static void *pbuf_pool_pop(enum pbuf_class class, uint16_t reserve)
+{
+    struct pbuf_free_node *node = pbuf_pools[class].free_list;
+
+    if (!node || pbuf_stats[class].free <= reserve) {
+        pbuf_stats[class].exhausted++;
+        return NULL;
+    }
+
+    pbuf_pools[class].free_list = node->next;
+
+    if (--pbuf_stats[class].free < pbuf_stats[class].low_water)
+        pbuf_stats[class].low_water = pbuf_stats[class].free;
+
+    return node;
+}
+
+static void *__pbuf_alloc(size_t size, int rx)
+{
+    enum pbuf_class class;
+    void *buf = NULL;
+    irq_flags_t flags;
+
+    flags = irq_disable();
+
+    for (class = 0; class < PBUF_NR_CLASSES && !buf; class++)
+        if (size <= pbuf_stats[class].size)
+            buf = pbuf_pool_pop(class, rx ? 0 : pbuf_rx_reserve[class]);
+
+    if (!buf)
+        pbuf_heap_fallbacks++;
+
+    irq_enable(flags);
+
+    if (!buf)
+        buf = get_mem_hint(size, MEM_HINT_DMA);
+
+    return buf;
+}
+
+void *pbuf_alloc(size_t size)
+{
+    return __pbuf_alloc(size, 0);
+}
+
+void *pbuf_alloc_rx(size_t size)
+{
+    return __pbuf_alloc(size, 1);
+}
+
+void pbuf_free(void *buf)
+{
+    enum pbuf_class class;
+    irq_flags_t flags;
+
+    if (!buf)
+        return;
+
+    for (class = 0; class < PBUF_NR_CLASSES; class++)
+        if ((uint8_t *)buf >= pbuf_pools[class].start &&
+            (uint8_t *)buf < pbuf_pools[class].end) {
+            flags = irq_disable();
+            pbuf_pool_push(class, buf);
+            irq_enable(flags);
+            return;
+        }
+
+    /* Not one of ours, it must have come from the heap. */
+    free_mem(buf);
+}
+
+static void pbuf_init(void)
+{
+    int i;
+
+    for (i = 0; i < PBUF_SMALL_NR; i++)
+        pbuf_pool_push(PBUF_SMALL, pbuf_small_mem[i]);
+
+    for (i = 0; i < PBUF_MTU_NR; i++)
+        pbuf_pool_push(PBUF_MTU, pbuf_mtu_mem[i]);
+
+    pbuf_stats[PBUF_SMALL].low_water = PBUF_SMALL_NR;
+    pbuf_stats[PBUF_MTU].low_water = PBUF_MTU_NR;
+}
+early_initcall(pbuf_init);
@@ -0,0 +1,73 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Packet buffer pool.
+ *
+ * Preallocated, fixed-size buffers for frames and packets on the hot
+ * path.  There are two classes: small buffers, big enough for an ARP
+ * packet or a bare TCP ACK, and MTU sized buffers, big enough for a
+ * whole Ethernet frame.  Allocation and liberation are constant time
+ * and may be done from interrupt context.
+ *
+ * The pool lives in the Ethernet AHB SRAM bank, so any buffer can be
+ * handed to the EMAC DMA.
+ */
+
+#define PBUF_SMALL_SZ 128
+#define PBUF_SMALL_NR 24
+
+#define PBUF_MTU_SZ 1536
+#define PBUF_MTU_NR 8
+
+/* MTU sized buffers that only pbuf_alloc_rx() may take, so that
+ * transmitted packets can't starve the receive ring of refills.  The
+ * ring itself holds RX_DESC_LEN more, taken at boot. */
+#define PBUF_MTU_RX_RESERVE 2
+
+enum pbuf_class {
+    PBUF_SMALL,
+    PBUF_MTU,
+    PBUF_NR_CLASSES
+};
+
+struct pbuf_stats
+{
+    uint16_t size;
+    uint16_t nr;
+    uint16_t free;
+
+    /* The fewest free buffers there have ever been. */
+    uint16_t low_water;
+
+    /* Allocations that found the class empty. */
+    uint32_t exhausted;
+};
+
+extern struct pbuf_stats pbuf_stats[PBUF_NR_CLASSES];
+
+/* Allocations that fell back to the heap as the pool was exhausted. */
+extern uint32_t pbuf_heap_fallbacks;
+
+/*
+ * Allocate a buffer of at least `size' bytes from the smallest class
+ * that fits, moving up a class if that one is exhausted.  Should the
+ * pool be unable to satisfy the request, the buffer comes from the
+ * part of the heap the EMAC DMA can reach instead.
+ *
+ * @returns NULL if the heap can't satisfy the request either.
+ */
+void *pbuf_alloc(size_t size);
+
+/*
+ * As pbuf_alloc(), but may also take the buffers held in reserve for
+ * refilling the receive ring.
+ */
+void *pbuf_alloc_rx(size_t size);
+
+/*
+ * Free a buffer returned by pbuf_alloc().  May safely be called with a
+ * NULL argument.
+ */
+void pbuf_free(void *buf);
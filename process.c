@@ -4,24 +4,39 @@
 #include "memory.h"
 #include "init.h"
 #include "lpc17xx.h"
+#include "tick.h"
+#include "tasklet.h"
+#include "error.h"
 #include <stdint.h>
 #include <string.h>
 
-static LIST(runqueue);
+/* One runqueue per priority.  Bit n of `runqueue_bitmap' is set when
+ * runqueues[n] is non-empty. */
+static list runqueues[PROCESS_NR_PRIOS];
+static uint32_t runqueue_bitmap;
 static LIST(waitqueue);
 static LIST(deadqueue);
+static LIST(processes);
 
 static process_t *current_tsk = NULL;
 static process_t *idle_tsk;
 
-#define STACK_SZ 0x400
+/* Set when the next PendSV should pick a process to run, rather than
+ * only run tasklets. */
+static volatile int resched_pending;
 
-static void reschedule()
+void process_resched(void)
 {
-    __irq_enable();
+    resched_pending = 1;
 
     /* Raise a PendSV for context switch. */
     LPC_SCB->ICSR |= ICSR_PENDSVSET_MASK;
+}
+
+static void reschedule()
+{
+    process_resched();
+    __irq_enable();
 
     asm volatile("wfe");
 }
@@ -31,15 +46,75 @@ process_t *process_get_cur_task(void)
     return current_tsk;
 }
 
-/* Move a given process from the waitqueue to the runqueue.
+/* Should be called with interrupts disabled. */
+static void runqueue_add(process_t *proc)
+{
+    list_add_tail(&proc->cur_sched_queue, &runqueues[proc->prio]);
+    runqueue_bitmap |= (1 << proc->prio);
+}
+
+/* Take the first process off the highest priority non-empty runqueue.
+ *
+ * Should be called with interrupts disabled. */
+static process_t *runqueue_pop(void)
+{
+    process_t *proc;
+    int prio;
+
+    if (!runqueue_bitmap)
+        return NULL;
+
+    prio = 31 - __builtin_clz(runqueue_bitmap);
+    list_pop(proc, &runqueues[prio], cur_sched_queue);
+
+    if (list_empty(&runqueues[prio]))
+        runqueue_bitmap &= ~(1 << prio);
+
+    return proc;
+}
+
+/* @returns 1 if `proc', just made ready, should run in place of the
+ * current process. */
+static int should_preempt(process_t *proc)
+{
+    if (!current_tsk)
+        return 0;
+
+    return current_tsk == idle_tsk || proc->prio > current_tsk->prio;
+}
+
+/* @returns 1 if a ready process is owed a turn in place of the
+ * current one.  Lower priority processes are never owed one, so a
+ * process running on its own at its priority keeps the CPU. */
+int process_need_resched(void)
+{
+    /* Nothing has been scheduled yet. */
+    if (!current_tsk)
+        return 1;
+
+    return (runqueue_bitmap >> current_tsk->prio) != 0;
+}
+
+/* Move a given process from the waitqueue to the runqueue.  If it has
+ * a higher priority than the current process, switch to it as soon as
+ * interrupts are enabled.
  */
 void process_wakeup(process_t *proc)
 {
     irq_flags_t flags = irq_disable();
     list_del(&proc->cur_sched_queue);
 
-    list_add(&proc->cur_sched_queue, &runqueue);
+    /* The current process may be woken before it has switched out.
+     * It stays RUNNING, and pick_new_task() puts it back on its
+     * runqueue. */
+    if (proc != current_tsk)
+        runqueue_add(proc);
+
     proc->state = RUNNING;
+
+    if (should_preempt(proc))
+        process_resched();
+
     irq_enable(flags);
 }
 
@@ -66,20 +141,57 @@ static void process_finish()
     reschedule();
 }
 
-static process_t *create_process(memaddr_t pc, memaddr_t r0)
+/* Paint `proc's stack, so process_get_stack_info() can tell how much
+ * of it has been used.  The stack must have been allocated. */
+static void process_stack_paint(process_t *proc)
+{
+    uint32_t *word;
+
+    for (word = proc->stack_base;
+         (void *)word < proc->stack_base + proc->stack_sz; word++)
+        *word = PROCESS_STACK_CANARY;
+}
+
+static process_t *create_process(memaddr_t pc, memaddr_t r0,
+                                 uint32_t stack_sz)
 {
     process_t *new_process = get_mem(sizeof(*new_process));
     hw_stack_ctx *new_hw_stack_ctx;
     sw_stack_ctx *new_sw_stack_ctx;
+    irq_flags_t flags;
+
+    if (!new_process)
+        return NULL;
+
+    stack_sz = (stack_sz + 7) & ~7;
+
+    /* We ask the heap for some new stack space.  Stacks are only
+     * touched by the CPU, so keep them out of the AHB bank and its
+     * packet buffers.  The heap only aligns to 4 bytes, so ask for 4
+     * more and start the stack on an 8 byte boundary; its top is
+     * then 8 byte aligned too. */
+    new_process->stack_alloc = get_mem_hint(stack_sz + 4, MEM_HINT_LOCAL);
+
+    if (!new_process->stack_alloc) {
+        free_mem(new_process);
+        return NULL;
+    }
+
+    new_process->stack_base =
+        (void *)(((memaddr_t)new_process->stack_alloc + 7) & ~7);
+    new_process->stack_sz = stack_sz;
+    new_process->entry = pc;
 
-    /* We ask the heap for some new stack space. */
-    new_process->stack_alloc = get_mem(STACK_SZ);
+    /* Not on any waitqueue. */
+    new_process->wait_entry.next = new_process->wait_entry.prev = NULL;
+
+    process_stack_paint(new_process);
 
     /* Since on the cortex-m, the stack is descending, move the
      * current stack pointer to the end of the allocation.  Reserve
      * space for the hw_stack_ctx too, as this will be pop'd off by
      * the HW when the process is first executed. */
-    new_hw_stack_ctx = (new_process->stack_alloc + STACK_SZ) -
+    new_hw_stack_ctx = (new_process->stack_base + stack_sz) -
         sizeof(hw_stack_ctx);
 
     /* Allocate space in the new stack for the SW stack context, as
@@ -96,17 +208,34 @@ static process_t *create_process(memaddr_t pc, memaddr_t r0)
     new_hw_stack_ctx->r0 = r0;
     new_hw_stack_ctx->psr = 0x01000000;
 
+    flags = irq_disable();
+    list_add_tail(&new_process->proc_entry, &processes);
+    irq_enable(flags);
+
     return new_process;
 }
 
-void process_spawn(memaddr_t pc, memaddr_t r0)
+int process_spawn(memaddr_t pc, memaddr_t r0, uint8_t prio,
+                  uint32_t stack_sz)
 {
-    process_t *newproc = create_process(pc, r0);
-    irq_flags_t flags = irq_disable();
+    process_t *newproc = create_process(pc, r0, stack_sz);
+    irq_flags_t flags;
+
+    if (!newproc)
+        return -ENOMEM;
 
-    list_add(&newproc->cur_sched_queue, &runqueue);
+    flags = irq_disable();
+
+    newproc->prio = prio;
     newproc->state = RUNNING;
+    runqueue_add(newproc);
+
+    if (should_preempt(newproc))
+        process_resched();
+
     irq_enable(flags);
+
+    return 0;
 }
 
 static void __idle_task(void)
@@ -118,40 +247,113 @@ static void __idle_task(void)
         list_pop(dead_process, &deadqueue, cur_sched_queue);
 
         if (dead_process) {
+            list_del(&dead_process->proc_entry);
             free_mem(dead_process->stack_alloc);
             free_mem(dead_process);
         }
 
-        irq_enable(flags);
-
+        /* Nothing else can run, so stretch the tick out to the
+         * next timer deadline before going to sleep.  WFI wakes on
+         * a pending interrupt even with interrupts disabled; it is
+         * taken as soon as they are enabled again. */
+        tick_idle_enter();
         asm volatile("wfi");
+
+        irq_enable(flags);
     }
 }
 
 void process_init(void)
 {
-    extern thread_t _sthreads, _ethreads;
-    thread_t *cur = &_sthreads;
+    extern struct thread_desc _sthreads, _ethreads;
+    struct thread_desc *cur = &_sthreads;
     uint32_t zero = 0;
+    int i;
+
+    for (i = 0; i < PROCESS_NR_PRIOS; i++)
+        INIT_LIST(&runqueues[i]);
+
+    /* A thread there isn't the memory for is left out, and the rest
+     * carry on without it. */
+    for (; cur != &_ethreads; cur++)
+        process_spawn((memaddr_t)cur->fn, 0, cur->prio, cur->stack_sz);
 
-    while (cur != &_ethreads)
-        process_spawn((memaddr_t)*cur++, 0);
+    /* The idle task is never on a runqueue; it runs whenever they
+     * are all empty. */
+    idle_tsk = create_process((memaddr_t)&__idle_task, 0,
+                              PROCESS_STACK_DEFAULT);
 
-    idle_tsk = create_process((memaddr_t)&__idle_task, 0);
+    if (!idle_tsk)
+        /* fatal error - there is nothing to run when every other
+         * process is waiting. */
+        asm volatile("b .");
+
+    idle_tsk->prio = 0;
 
     /* To kick off, we want the PSP to be NULL, so that irq_pendsv
      * doesn't attempt to stack values of an empty task. */
     asm volatile("msr psp, %0" : : "r"(zero));
 }
 
+/* @returns the most of `proc's stack that has been used, going by
+ * how much of the paint has been overwritten. */
+static uint32_t process_stack_peak(process_t *proc)
+{
+    uint32_t *word = proc->stack_base;
+    uint32_t *end = proc->stack_base + proc->stack_sz;
+
+    while (word < end && *word == PROCESS_STACK_CANARY)
+        word++;
+
+    return (void *)end - (void *)word;
+}
+
+int process_get_stack_info(struct process_stack_info *info, int max)
+{
+    process_t *proc;
+    int n = 0;
+    irq_flags_t flags = irq_disable();
+
+    list_for_each(proc, &processes, proc_entry) {
+        if (n == max)
+            break;
+
+        info[n].entry = proc->entry;
+        info[n].size = proc->stack_sz;
+        info[n].peak = process_stack_peak(proc);
+        n++;
+    }
+
+    irq_enable(flags);
+
+    return n;
+}
+
 void *pick_new_task(void *current_stack)
 {
-    /* Select the next task to be executed in a simple round-robin
-     * fashion.
+    /* Select the highest priority task ready to run, taking turns
+     * with any others of the same priority.
      *
-     * Should be called with interrupts disabled.*/
+     * Called from PendSV with interrupts enabled.  Scheduled
+     * tasklets run first, still with interrupts enabled; the
+     * scheduling decision is then made under irq_disable(). */
     process_t *next;
-    irq_flags_t flags = irq_disable();
+    irq_flags_t flags;
+
+    /* Deferred work comes first, with interrupts enabled.  It may
+     * wake processes. */
+    tasklet_run();
+
+    flags = irq_disable();
+
+    /* PendSV was raised only to run tasklets; carry on with the
+     * current process. */
+    if (current_tsk && !resched_pending) {
+        irq_enable(flags);
+        return current_stack;
+    }
+
+    resched_pending = 0;
 
     if (current_tsk) {
 
@@ -165,15 +367,17 @@ void *pick_new_task(void *current_stack)
         /* Since we could be called for a process that has just been
          * put to sleep, ensure the process is in a RUNNING state
          * before adding back to the runqueue. */
-        if (current_tsk->state == RUNNING)
-            list_add_tail(&current_tsk->cur_sched_queue, &runqueue);
+        if (current_tsk->state == RUNNING && current_tsk != idle_tsk)
+            runqueue_add(current_tsk);
     }
 
-    /* Pick the head of the runqueue. */
-    list_pop(next, &runqueue, cur_sched_queue);
+    next = runqueue_pop();
 
     if (!next)
         next = idle_tsk;
+    else if (current_tsk == idle_tsk)
+        /* Leaving idle, bring back the periodic tick. */
+        tick_idle_exit();
 
     /* Set as current task. */
     current_tsk = next;
@@ -26,11 +26,41 @@ typedef struct {
     memaddr_t r11;
 } sw_stack_ctx;
 
+/* Thread priorities.  A ready thread always runs in preference to
+ * any ready thread of lower priority; threads of equal priority take
+ * turns, a tick at a time. */
+#define PROCESS_NR_PRIOS 8
+
+#define PROCESS_PRIO_DEFAULT 2  /* Application threads. */
+#define PROCESS_PRIO_NET_TX  5  /* Network transmit path. */
+#define PROCESS_PRIO_NET_RX  6  /* Network receive path. */
+
+/* Stack size of a thread that doesn't ask for one.  Rounded up to a
+ * multiple of 8 bytes, as the ABI wants the stack pointer aligned. */
+#define PROCESS_STACK_DEFAULT 0x400
+
+/* Unused stack is painted with this, so that the peak usage can be
+ * found afterwards. */
+#define PROCESS_STACK_CANARY 0xa5a5a5a5
+
 typedef struct
 {
     void *cur_stack;
     void *stack_alloc;
+
+    /* The stack proper, 8 byte aligned within `stack_alloc'. */
+    void *stack_base;
+    uint32_t stack_sz;
+    memaddr_t entry;
     list cur_sched_queue;
+
+    /* Links the process into the list of all processes. */
+    list proc_entry;
+
+    /* Links the process into the waitqueue it is sleeping on. */
+    list wait_entry;
+
+    uint8_t prio;
     enum {
         RUNNING,
         WAITING,
@@ -41,11 +71,52 @@ typedef struct
 process_t *process_get_cur_task(void);
 void process_init(void);
 void process_wait(void);
-void process_spawn(memaddr_t pc, memaddr_t r0);
+
+/* Start a process running `pc' with `r0' as its argument.
+ *
+ * @returns 0 on success, -ENOMEM if out of memory. */
+int process_spawn(memaddr_t pc, memaddr_t r0, uint8_t prio,
+                  uint32_t stack_sz);
+
 void process_wakeup(process_t *proc);
+int process_need_resched(void);
+
+/* Have a process picked to run, possibly the current one, once
+ * interrupt handlers are done. */
+void process_resched(void);
+
+struct process_stack_info
+{
+    memaddr_t entry;    /* Function the process was started at */
+    uint32_t size;      /* Size of its stack */
+    uint32_t peak;      /* Most of the stack it has used so far */
+};
+
+/*
+ * Fill in the stack usage of up to `max' processes, the idle task
+ * included.
+ *
+ * This function scans every stack with interrupts disabled, and is
+ * meant for diagnostics, not to be called from time critical code.
+ *
+ * @returns the number of entries filled in.
+ */
+int process_get_stack_info(struct process_stack_info *info, int max);
 
 typedef void (*thread_t)(void);
 
-#define thread(fn)                                     \
-    static volatile thread_t __thread_##fn             \
-    __attribute__((__section__(".threads"))) = fn;
+struct thread_desc
+{
+    thread_t fn;
+    uint32_t prio;
+    uint32_t stack_sz;
+};
+
+/* Declare `fn' as a thread, started at boot with priority `prio' and
+ * a stack of `stack_sz' bytes. */
+#define thread_stack(fn, prio, stack_sz)                       \
+    static volatile struct thread_desc __thread_##fn           \
+    __attribute__((__section__(".threads"))) = { fn, prio, stack_sz };
+
+#define thread_prio(fn, prio) thread_stack(fn, prio, PROCESS_STACK_DEFAULT)
+#define thread(fn) thread_prio(fn, PROCESS_PRIO_DEFAULT)
@@ -1,26 +1,129 @@
 #include "irq.h"
-#include "wait.h"
-#include "memory.h"
+#include "msgq.h"
+#include "event.h"
+#include "pbuf.h"
+#include "slab.h"
 #include "protocol.h"
+#include "ethernet.h"
+#include "ipv4.h"
+#include "tcp.h"
+#include "udp.h"
+#include "macros.h"
+#include "error.h"
+#include <string.h>
+
+/* Space for the largest stack of headers a transmitted packet can
+ * carry: Ethernet, IPv4 and then TCP or UDP. */
+#define TX_HEADROOM (sizeof(ethernet_header) + sizeof(ip4_header) + \
+                     MAX(sizeof(tcp_header), sizeof(udp_header)))
+
+static SLAB_CACHE(packet_cache, struct packet_t);
 
 static LIST(protocol_head);
-static LIST(pkt_rx_q);
-static WAITQUEUE(rx_waitq);
+
+/* Packets waiting for the rx task.  A poll pass injects at most
+ * RX_POLL_BUDGET, and the rx task drains the queue between passes. */
+#define PKT_RX_Q_LEN (2 * RX_POLL_BUDGET)
+
+static MSGQ(pkt_rx_q, PKT_RX_Q_LEN);
+
+/* What the rx task is woken for. */
+#define RX_EVENT_PKT  (1 << 0)  /* Packets queued on pkt_rx_q */
+#define RX_EVENT_POLL (1 << 1)  /* A driver asked to be polled */
+
+static EVENT_FLAGS(rx_events);
+
+/* Set by a driver to have the rx task poll it for frames. */
+static volatile rx_poll_func_t rx_poll_fn;
+
+struct rx_poll_stats rx_poll_stats;
 
 struct packet_t *packet_create(void *frame, size_t frame_len)
 {
-    struct packet_t *ret = get_mem(sizeof(*ret));
+    struct packet_t *ret = slab_alloc(&packet_cache);
+
+    if (!ret)
+        return NULL;
 
     ret->data = ret->cur_data = frame;
     ret->data_length = ret->cur_data_length = frame_len;
+    ret->nr_frags = 0;
+
+    return ret;
+}
+
+struct packet_t *packet_alloc_tx(size_t payload_len)
+{
+    struct packet_t *ret = slab_alloc(&packet_cache);
+
+    if (!ret)
+        return NULL;
+
+    ret->data = pbuf_alloc(TX_HEADROOM + payload_len);
+
+    if (!ret->data) {
+        slab_free(&packet_cache, ret);
+        return NULL;
+    }
+
+    ret->data_length = TX_HEADROOM + payload_len;
+    ret->cur_data = ret->data + TX_HEADROOM;
+    ret->cur_data_length = payload_len;
+    ret->nr_frags = 0;
 
     return ret;
 }
 
+int packet_append(struct packet_t *pkt, const void *data, size_t len)
+{
+    struct packet_frag *frag;
+    void *buf;
+
+    /* The EMAC can't send an empty buffer. */
+    if (!len)
+        return 0;
+
+    buf = pbuf_alloc(len);
+
+    if (!buf)
+        return -ENOMEM;
+
+    frag = &pkt->frags[pkt->nr_frags++];
+    frag->data = buf;
+    frag->length = len;
+    memcpy(frag->data, data, len);
+
+    return 0;
+}
+
+size_t packet_len(struct packet_t *pkt)
+{
+    size_t len = pkt->cur_data_length;
+    int i;
+
+    for (i = 0; i < pkt->nr_frags; i++)
+        len += pkt->frags[i].length;
+
+    return len;
+}
+
+void *packet_push(struct packet_t *pkt, size_t hdr_len)
+{
+    pkt->cur_data -= hdr_len;
+    pkt->cur_data_length += hdr_len;
+
+    return pkt->cur_data;
+}
+
 void packet_destroy(struct packet_t *pkt)
 {
-    free_mem(pkt->data);
-    free_mem(pkt);
+    int i;
+
+    for (i = 0; i < pkt->nr_frags; i++)
+        pbuf_free(pkt->frags[i].data);
+
+    pbuf_free(pkt->data);
+    slab_free(&packet_cache, pkt);
 }
 
 /* Inject a packet_t into the networking stack.  The destination
@@ -28,11 +131,52 @@ void packet_destroy(struct packet_t *pkt)
  * packet. */
 void packet_inject(struct packet_t *pkt, enum protocol_type type)
 {
-    irq_flags_t flags = irq_disable();
     pkt->handler = type;
-    list_add(&pkt->cur_q, &pkt_rx_q);
-    waitqueue_wakeup(&rx_waitq);
+
+    if (msgq_post(&pkt_rx_q, pkt)) {
+        rx_poll_stats.queue_full++;
+        packet_destroy(pkt);
+        return;
+    }
+
+    event_flags_set(&rx_events, RX_EVENT_PKT);
+}
+
+/* Schedule `poll' to be run from the rx task.  Intended to be called
+ * from a driver's interrupt handler, which should then keep its
+ * receive interrupt masked until `poll' has drained the hardware. */
+void packet_rx_schedule(rx_poll_func_t poll)
+{
+    rx_poll_fn = poll;
+    event_flags_set(&rx_events, RX_EVENT_POLL);
+}
+
+/* Run a single poll pass and account for it. */
+static void rx_poll(void)
+{
+    rx_poll_func_t poll;
+    irq_flags_t flags;
+    int work;
+
+    flags = irq_disable();
+    poll = rx_poll_fn;
+    rx_poll_fn = NULL;
     irq_enable(flags);
+
+    if (!poll)
+        return;
+
+    work = poll(RX_POLL_BUDGET);
+
+    rx_poll_stats.passes++;
+    rx_poll_stats.frames += work;
+    rx_poll_stats.frames_per_pass[work]++;
+
+    /* The budget was used up, so there may be more frames waiting.
+     * Poll again on the next pass; the driver keeps its interrupt
+     * masked in the meantime. */
+    if (work >= RX_POLL_BUDGET)
+        packet_rx_schedule(poll);
 }
 
 void protocol_register(struct protocol_t *protocol)
@@ -52,33 +196,40 @@ static struct protocol_t *resolve_pkt_protocol(struct packet_t *pkt)
     return NULL;
 }
 
+/* Pass a packet up through each protocol layer in turn until one of
+ * them drops it. */
+static void rx_process_pkt(struct packet_t *pkt)
+{
+    while (pkt) {
+        struct protocol_t *proto = resolve_pkt_protocol(pkt);
+
+        if (!proto)
+            /* We couldn't find a protocol handler for this packet.
+             * Drop it. */
+            pkt->handler = DROP;
+        else
+            proto->rx_pkt(pkt);
+
+        if (pkt->handler == DROP) {
+            packet_destroy(pkt);
+            pkt = NULL;
+        }
+    }
+}
+
 static void rx_task(void)
 {
     while (1) {
-        irq_flags_t flags;
-        struct packet_t *pkt;
+        void *pkt;
 
-        wait_for_volatile_condition(!list_empty(&pkt_rx_q), rx_waitq);
+        event_flags_wait(&rx_events, RX_EVENT_PKT | RX_EVENT_POLL);
 
-        flags = irq_disable();
-        list_pop(pkt, &pkt_rx_q, cur_q);
-        irq_enable(flags);
+        rx_poll();
 
-        while (pkt) {
-            struct protocol_t *proto = resolve_pkt_protocol(pkt);
-
-            if (!proto)
-                /* We couldn't find a protocol handler for this packet.
-                 * Drop it. */
-                pkt->handler = DROP;
-            else
-                proto->rx_pkt(pkt);
-
-            if (pkt->handler == DROP) {
-                packet_destroy(pkt);
-                pkt = NULL;
-            }
-        }
+        /* Process everything this poll pass produced before polling
+         * the driver again. */
+        while (!msgq_recv(&pkt_rx_q, &pkt, 0))
+            rx_process_pkt(pkt);
     }
 }
-thread(rx_task)
+thread_prio(rx_task, PROCESS_PRIO_NET_RX)
@@ -1,7 +1,10 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 #include "list.h"
 
+/* Most frames the rx task takes from a driver per poll pass. */
+#define RX_POLL_BUDGET 4
 
 enum protocol_type {
     ETHERNET,
@@ -18,6 +21,16 @@ enum protocol_type {
 struct ipv4_pkt_info {
     uint32_t src_ip;
     uint32_t dst_ip;
+    uint8_t protocol;
+};
+
+/* Most buffers a transmit packet may chain behind its head buffer. */
+#define PACKET_MAX_FRAGS 2
+
+/* A piece of a packet's data held in a buffer of its own. */
+struct packet_frag {
+    void *data;
+    size_t length;
 };
 
 struct packet_t
@@ -28,7 +41,11 @@ struct packet_t
     size_t cur_data_length;
     enum protocol_type handler;
     struct ipv4_pkt_info ip4_info;
-    list cur_q;
+
+    /* On transmit, the data continues past `cur_data' with these
+     * buffers, in order.  Received packets never have any. */
+    int nr_frags;
+    struct packet_frag frags[PACKET_MAX_FRAGS];
 };
 
 typedef void (*rx_pkt_func_t)(struct packet_t *pkt);
@@ -40,10 +57,57 @@ struct protocol_t
     list next_protocol;
 };
 
+/* A receive poll function hands up to `budget' frames to the stack
+ * with packet_inject() and returns how many it consumed. */
+typedef int (*rx_poll_func_t)(int budget);
+
+struct rx_poll_stats
+{
+    uint32_t passes;
+    uint32_t frames;
+
+    /* Indexed by the number of frames a single pass handled.  The
+     * last bucket counts passes that used up their whole budget. */
+    uint32_t frames_per_pass[RX_POLL_BUDGET + 1];
+
+    /* Frames dropped because the rx queue was full. */
+    uint32_t queue_full;
+};
+
+extern struct rx_poll_stats rx_poll_stats;
+
 #define for_each_protocol(pos)        \
     list_for_each((pos), &protocol_head, next_protocol)
 
+/* Wrap a received frame in a packet.  @returns NULL if out of
+ * memory, in which case the frame still belongs to the caller. */
 struct packet_t *packet_create(void *frame, size_t frame_len);
+
+/* Allocate a packet for transmission with room for `payload_len'
+ * bytes of payload at `cur_data', preceded by enough headroom for
+ * every header the stack may put in front of it.
+ *
+ * @returns NULL if out of memory. */
+struct packet_t *packet_alloc_tx(size_t payload_len);
+
+/* Copy `len' bytes from `data' into a new buffer chained on the end
+ * of a transmit packet.  The packet must have fewer than
+ * PACKET_MAX_FRAGS buffers chained already.
+ *
+ * @returns 0 on success, -ENOMEM if out of memory. */
+int packet_append(struct packet_t *pkt, const void *data, size_t len);
+
+/* @returns the length of a packet's data from `cur_data' onwards,
+ * including any chained buffers. */
+size_t packet_len(struct packet_t *pkt);
+
+/* Grow a transmit packet's data by `hdr_len' bytes at the front, for
+ * the caller to fill in its header.
+ *
+ * @returns the new start of the data. */
+void *packet_push(struct packet_t *pkt, size_t hdr_len);
+
 void packet_destroy(struct packet_t *pkt);
 void packet_inject(struct packet_t *pkt, enum protocol_type type);
+void packet_rx_schedule(rx_poll_func_t poll);
 void protocol_register(struct protocol_t *protocol);
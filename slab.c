@@ -0,0 +1,76 @@
+#include "slab.h"
+#include "memory.h"
+#include "irq.h"
+
+struct slab_free_node
+{
+    struct slab_free_node *next;
+};
+
+LIST(slab_caches);
+
+static void slab_push(struct slab_cache *cache, void *obj)
+{
+    struct slab_free_node *node = obj;
+
+    node->next = cache->free_list;
+    cache->free_list = node;
+    cache->stats.free++;
+}
+
+/* Carve a new page into objects and put them all on the free list.
+ * Called with interrupts disabled. */
+static void slab_grow(struct slab_cache *cache)
+{
+    size_t page_sz = MAX(SLAB_PAGE_SZ, cache->obj_size);
+    uint8_t *page = get_mem_hint(page_sz, MEM_HINT_LOCAL);
+    size_t offset;
+
+    if (!page)
+        return;
+
+    if (!cache->stats.pages)
+        list_add_tail(&cache->next, &slab_caches);
+
+    cache->stats.pages++;
+
+    for (offset = 0; offset + cache->obj_size <= page_sz;
+         offset += cache->obj_size)
+        slab_push(cache, page + offset);
+}
+
+void *slab_alloc(struct slab_cache *cache)
+{
+    struct slab_free_node *node;
+    irq_flags_t flags = irq_disable();
+
+    if (!cache->free_list)
+        slab_grow(cache);
+
+    node = cache->free_list;
+
+    if (node) {
+        cache->free_list = node->next;
+        cache->stats.free--;
+
+        if (++cache->stats.in_use > cache->stats.peak)
+            cache->stats.peak = cache->stats.in_use;
+    }
+
+    irq_enable(flags);
+
+    return node;
+}
+
+void slab_free(struct slab_cache *cache, void *obj)
+{
+    irq_flags_t flags;
+
+    if (!obj)
+        return;
+
+    flags = irq_disable();
+    slab_push(cache, obj);
+    cache->stats.in_use--;
+    irq_enable(flags);
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "list.h"
+#include "macros.h"
+
+/*
+ * Object caches.
+ *
+ * A cache hands out objects of a single type, packed into pages taken
+ * from the heap as the cache grows.  Freed objects go back on their
+ * cache's free list rather than to the heap, so objects allocated and
+ * freed on every packet or wait neither fragment the heap nor pay for
+ * a free list search.  Allocation, bar the occasional new page, and
+ * liberation are constant time and may be done from interrupt context.
+ * Pages are kept by their cache once allocated, and come from the local
+ * SRAM bank when it has room.
+ */
+
+/* Heap taken by a cache each time it grows, unless a single object is
+ * bigger than that. */
+#define SLAB_PAGE_SZ 256
+
+struct slab_free_node;
+
+struct slab_stats
+{
+    uint16_t in_use;
+
+    /* The most objects there have ever been in use at once. */
+    uint16_t peak;
+
+    /* Objects sitting on the free list. */
+    uint16_t free;
+
+    uint16_t pages;
+};
+
+struct slab_cache
+{
+    const char *name;
+    size_t obj_size;
+    struct slab_free_node *free_list;
+    struct slab_stats stats;
+
+    /* Links caches that have grown at least once into `slab_caches'. */
+    list next;
+};
+
+/* Define a cache named `cache' for objects of type `type'. */
+#define SLAB_CACHE(cache, type)                                         \
+    struct slab_cache cache = {                                         \
+        .name = #type,                                                  \
+        .obj_size = P2ROUND(MAX(sizeof(type), sizeof(void *)),          \
+                            sizeof(void *)),                            \
+    }
+
+/* Every cache in use, for walking the stats from a debugger. */
+extern list slab_caches;
+
+/* Allocate an uninitialised object from `cache'.
+ *
+ * @returns NULL if the cache is empty and the heap has no room for a
+ * new page. */
+void *slab_alloc(struct slab_cache *cache);
+
+/* Give `obj' back to the cache it was allocated from.  May safely be
+ * called with a NULL argument. */
+void slab_free(struct slab_cache *cache, void *obj);
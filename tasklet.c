@@ -0,0 +1,55 @@
+#include "tasklet.h"
+#include "irq.h"
+#include "init.h"
+#include "lpc17xx.h"
+#include <stddef.h>
+
+/* Lowest exception priority; PendSV is preempted by every
+ * interrupt. */
+#define PENDSV_PRIO 0xFF
+
+static LIST(tasklets);
+
+void tasklet_schedule(struct tasklet *tasklet)
+{
+    irq_flags_t flags = irq_disable();
+
+    if (!tasklet->pending) {
+        tasklet->pending = 1;
+        list_add_tail(&tasklet->entry, &tasklets);
+
+        LPC_SCB->ICSR |= ICSR_PENDSVSET_MASK;
+    }
+
+    irq_enable(flags);
+}
+
+void tasklet_run(void)
+{
+    struct tasklet *tasklet;
+
+    for (;;) {
+        irq_flags_t flags = irq_disable();
+
+        list_pop(tasklet, &tasklets, entry);
+
+        /* Clear `pending' before running it, so that anything that
+         * comes up while it runs gets it scheduled again. */
+        if (tasklet)
+            tasklet->pending = 0;
+
+        irq_enable(flags);
+
+        if (!tasklet)
+            break;
+
+        tasklet->fn(tasklet);
+    }
+}
+
+static void tasklet_init(void)
+{
+    /* System handler priority of PendSV, exception 14. */
+    LPC_SCB->SHP[10] = PENDSV_PRIO;
+}
+early_initcall(tasklet_init);
@@ -0,0 +1,38 @@
+#pragma once
+#include "list.h"
+
+/*
+ * Tasklets.
+ *
+ * Work deferred by an interrupt handler, so that it can acknowledge
+ * its hardware and return.  Scheduled tasklets run in the PendSV
+ * handler, which has the lowest priority of any exception: with
+ * interrupts enabled, after every interrupt handler has returned and
+ * before any thread runs again.
+ *
+ * Tasklets run one at a time, in the order they were scheduled, and
+ * must not block.
+ */
+
+struct tasklet;
+
+typedef void (*tasklet_fn_t)(struct tasklet *tasklet);
+
+struct tasklet
+{
+    list entry;
+    volatile int pending;
+    tasklet_fn_t fn;
+};
+
+#define TASKLET(name, tasklet_fn) \
+    struct tasklet name = { .fn = tasklet_fn }
+
+/* Have `tasklet' run once interrupt handlers are done.  Scheduling a
+ * tasklet that hasn't run yet does nothing, so a tasklet should
+ * handle everything that is outstanding each time it runs.  Safe to
+ * call from an interrupt handler. */
+void tasklet_schedule(struct tasklet *tasklet);
+
+/* Run every scheduled tasklet.  Called from the PendSV handler. */
+void tasklet_run(void);
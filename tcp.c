@@ -2,9 +2,10 @@
 #include "byteswap.h"
 #include "ipv4.h"
 #include "ethernet.h"
-#include "memory.h"
+#include "slab.h"
+#include "pbuf.h"
+#include "error.h"
 #include "protocol.h"
-#include "tick.h"
 #include "init.h"
 #include "wait.h"
 #include <string.h>
@@ -12,6 +13,10 @@
 #define TCP_TIMEOUT 250
 #define TCP_BUF_SZ 127
 
+/* Below this many free MTU sized packet buffers, the advertised window
+ * is scaled down, reaching zero when none are left. */
+#define TCP_PBUF_RESERVE 2
+
 typedef struct
 {
     uint32_t src;
@@ -22,7 +27,7 @@ typedef struct
 } tcp_pseudo;
 
 
-static WAITQUEUE(tcp_waitq);
+static SLAB_CACHE(tcb_cache, tcb);
 LIST(tcb_head);
 
 static void tcp_swap_endian(tcp_header *header)
@@ -43,36 +48,62 @@ static void tcp_swap_pseudo_endian(tcp_pseudo *pheader)
     swap_endian16(&pheader->length);
 }
 
-static void tcp_compute_checksum(tcp_header *header, tcp_pseudo *pheader,
-                                 void *payload_data, size_t payload_len)
+/* Add `len' bytes at `buf' to a running one's complement sum.  An odd
+ * trailing byte is summed as if padded with a zero, so only the last
+ * buffer summed may have an odd length. */
+static uint32_t tcp_checksum_add(uint32_t sum, void *buf, size_t len)
 {
-    void *buf;
-    uint16_t *x;
-    size_t buf_sz = sizeof(*header) + sizeof(*pheader) + payload_len;
-    uint32_t sum = 0;
+    uint16_t *x = buf;
     int i;
 
-    if (buf_sz % 2)
-        buf_sz += 1;
+    for (i = 0; i < len / 2; i++)
+        sum += x[i];
 
-    buf = get_mem(buf_sz);
-    memset(buf, 0, buf_sz);
+    if (len % 2)
+        sum += ((uint8_t *)buf)[len - 1];
 
-    memcpy(buf, pheader, sizeof(*pheader));
-    memcpy(buf + sizeof(*pheader), header, sizeof(*header));
-    memcpy(buf + sizeof(*pheader) + sizeof(*header), payload_data, payload_len);
+    return sum;
+}
 
-    x = buf;
+/* Checksum the pseudo header and the TCP segment in `pkt', as laid
+ * out in the buffers it will be sent from. */
+static void tcp_compute_checksum(tcp_pseudo *pheader, struct packet_t *pkt)
+{
+    tcp_header *header = pkt->cur_data;
+    uint32_t sum = 0;
+    int i;
 
-    for (i = 0; i < buf_sz / 2; i++)
-        sum += x[i];
+    sum = tcp_checksum_add(sum, pheader, sizeof(*pheader));
+    sum = tcp_checksum_add(sum, pkt->cur_data, pkt->cur_data_length);
+
+    for (i = 0; i < pkt->nr_frags; i++)
+        sum = tcp_checksum_add(sum, pkt->frags[i].data,
+                               pkt->frags[i].length);
 
     while (sum >> 16)
         sum = (sum & 0xffff) + (sum >> 16);
 
     header->checksum = ~sum;
+}
+
+/* The window to advertise for `t'.  Received frames each take an MTU
+ * sized packet buffer however small they are, so when those run low,
+ * shrink the window to slow the peer down before frames get dropped.
+ *
+ * Only the pool is looked at, deliberately.  Once it is empty, the
+ * receive ring is refilled from the DMA heap (see
+ * pbuf_heap_fallbacks), and the window stays shut while that
+ * happens: the heap is a reserve shared with everything else, not
+ * buffer space to offer the peer. */
+static uint16_t tcp_rx_window(tcb *t)
+{
+    size_t window = circular_buf_cur_capacity(&t->rx_buf);
+    size_t pbufs_free = pbuf_stats[PBUF_MTU].free;
 
-    free_mem(buf);
+    if (pbufs_free < TCP_PBUF_RESERVE)
+        window = window * pbufs_free / TCP_PBUF_RESERVE;
+
+    return window;
 }
 
 static void tcp_header_prepopulate(tcb *t, tcp_header *header)
@@ -83,14 +114,26 @@ static void tcp_header_prepopulate(tcb *t, tcp_header *header)
     header->ack_n = t->cur_ack_n;
     header->data_offset = 5;
 
-    header->window_sz = circular_buf_cur_capacity(&t->rx_buf);
+    header->window_sz = tcp_rx_window(t);
 }
 
-static void tcp_tx(tcp_header header, uint32_t dest_ip,
-                   void *payload, size_t payload_len)
+/* @returns 0 once the segment is queued, -ENOMEM if out of memory.
+ * Only data has to be retried by the caller; a lost control segment
+ * is recovered from like one lost on the wire. */
+static int tcp_tx(tcp_header header, uint32_t dest_ip,
+                  void *payload, size_t payload_len)
 {
+    struct packet_t *pkt = packet_alloc_tx(0);
     tcp_pseudo pheader;
-    void *buf = &header;
+    tcp_header *hdr;
+
+    if (!pkt)
+        return -ENOMEM;
+
+    if (packet_append(pkt, payload, payload_len)) {
+        packet_destroy(pkt);
+        return -ENOMEM;
+    }
 
     memset(&pheader, 0, sizeof(pheader));
 
@@ -102,17 +145,56 @@ static void tcp_tx(tcp_header header, uint32_t dest_ip,
     tcp_swap_endian(&header);
     tcp_swap_pseudo_endian(&pheader);
 
-    tcp_compute_checksum(&header, &pheader, payload, payload_len);
+    hdr = packet_push(pkt, sizeof(*hdr));
+    memcpy(hdr, &header, sizeof(*hdr));
 
-    buf = get_mem(sizeof(header) + payload_len);
+    tcp_compute_checksum(&pheader, pkt);
 
-    memcpy(buf, &header, sizeof(header));
-    memcpy(buf + sizeof(header), payload, payload_len);
+    ip4_xmit_packet(IP_PROTO_TCP, dest_ip, pkt);
 
-    ip4_xmit_packet(IP_PROTO_TCP, dest_ip, buf,
-                    sizeof(header) + payload_len);
+    return 0;
+}
 
-    free_mem(buf);
+/* Add `t' to, or take it off, the list of tcbs.  The list is walked
+ * by the rx task and changed by timer expiry too, so every change
+ * is made with interrupts disabled. */
+static void tcb_link(tcb *t)
+{
+    irq_flags_t flags = irq_disable();
+    list_add(&t->tcb_next, &tcb_head);
+    irq_enable(flags);
+}
+
+static void tcb_unlink(tcb *t)
+{
+    irq_flags_t flags = irq_disable();
+    list_del(&t->tcb_next);
+    irq_enable(flags);
+}
+
+/* The rx task arms the TIME_WAIT timer only once it is done with the
+ * tcb, and stops it before using the tcb again, so the tcb can be
+ * freed here. */
+static void tcp_timer_expire(struct timer *timer)
+{
+    tcb *cur = list_entry(timer, tcb, timer);
+
+    cur->timed_out = 1;
+
+    if (cur->state == TIME_WAIT) {
+        tcb_unlink(cur);
+        circular_buf_free(&cur->rx_buf);
+        slab_free(&tcb_cache, cur);
+        return;
+    }
+
+    waitqueue_wakeup(&cur->waitq);
+}
+
+static void tcp_timer_start(tcb *t)
+{
+    t->timed_out = 0;
+    timer_start(&t->timer, TCP_TIMEOUT);
 }
 
 static void tcp_rx_packet(struct packet_t *pkt)
@@ -121,7 +203,8 @@ static void tcp_rx_packet(struct packet_t *pkt)
     tcp_header *incoming = (tcp_header *)pkt->cur_data;
     size_t tcp_header_sz = incoming->data_offset * 4;
     size_t data_len;
-    int send_ack = 0;
+    int send_ack = 0, time_wait = 0;
+    irq_flags_t flags;
 
     pkt->cur_data += tcp_header_sz;
     pkt->cur_data_length -= tcp_header_sz;
@@ -133,7 +216,10 @@ static void tcp_rx_packet(struct packet_t *pkt)
      * protocol. */
     pkt->handler = DROP;
 
-    /* Find the TCB that this packet was for. */
+    /* Find the TCB that this packet was for, and stop its timer
+     * before a TIME_WAIT expiry can free it from under us. */
+    flags = irq_disable();
+
     list_for_each(i, &tcb_head, tcb_next)
         if (incoming->dest_port == i->src_port &&
             incoming->source_port == i->dst_port &&
@@ -154,6 +240,14 @@ static void tcp_rx_packet(struct packet_t *pkt)
             }
     }
 
+    /* We've received a packet for this tcb, stop any timeout. */
+    if (referenced_tcb) {
+        timer_stop(&referenced_tcb->timer);
+        referenced_tcb->timed_out = 0;
+    }
+
+    irq_enable(flags);
+
     if (referenced_tcb == NULL) {
         tcp_header response;
 
@@ -184,12 +278,6 @@ static void tcp_rx_packet(struct packet_t *pkt)
         return;
     }
 
-    /* We've received a packet for this tcb, stop any timeout
-     * counters. */
-    referenced_tcb->decrement_timeout = 0;
-    referenced_tcb->timed_out = 0;
-    referenced_tcb->timeout = 0;
-
     if (referenced_tcb->state == CLOSE_WAIT) {
         __irq_disable();
         asm("b .");
@@ -274,8 +362,8 @@ static void tcp_rx_packet(struct packet_t *pkt)
         if (incoming->ack &&
             incoming->ack_n == referenced_tcb->cur_ack_n + 1) {
             circular_buf_free(&referenced_tcb->rx_buf);
-            list_del(&referenced_tcb->tcb_next);
-            free_mem(referenced_tcb);
+            tcb_unlink(referenced_tcb);
+            slab_free(&tcb_cache, referenced_tcb);
 
             return;
         }
@@ -288,8 +376,7 @@ static void tcp_rx_packet(struct packet_t *pkt)
             referenced_tcb->cur_ack_n = incoming->seq_n + 1;
             send_ack = 1;
             referenced_tcb->state = TIME_WAIT;
-            referenced_tcb->timeout = TCP_TIMEOUT;
-            referenced_tcb->decrement_timeout = 1;
+            time_wait = 1;
             break;
         }
 
@@ -315,8 +402,7 @@ static void tcp_rx_packet(struct packet_t *pkt)
             referenced_tcb->cur_ack_n == incoming->ack_n;
             send_ack = 1;
             referenced_tcb->state = TIME_WAIT;
-            referenced_tcb->timeout = TCP_TIMEOUT;
-            referenced_tcb->decrement_timeout = 1;
+            time_wait = 1;
         }
         break;
     }
@@ -326,8 +412,7 @@ static void tcp_rx_packet(struct packet_t *pkt)
             referenced_tcb->cur_ack_n = incoming->ack;
 
         referenced_tcb->state = TIME_WAIT;
-        referenced_tcb->timeout = TCP_TIMEOUT;
-        referenced_tcb->decrement_timeout = 1;
+        time_wait = 1;
         break;
     }
     }
@@ -345,24 +430,48 @@ static void tcp_rx_packet(struct packet_t *pkt)
         tcp_tx(resp, pkt->ip4_info.src_ip, NULL, 0);
     }
 
-    waitqueue_wakeup(&tcp_waitq);
+    waitqueue_wakeup(&referenced_tcb->waitq);
+
+    /* Last, as the tcb is freed when the timer expires. */
+    if (time_wait)
+        tcp_timer_start(referenced_tcb);
+}
+
+/* @returns a zeroed tcb with its receive buffer allocated, or NULL if
+ * out of memory. */
+static tcb *tcb_alloc(void)
+{
+    tcb *new_tcb = slab_alloc(&tcb_cache);
+
+    if (!new_tcb)
+        return NULL;
+
+    memset(new_tcb, 0, sizeof(*new_tcb));
+    INIT_WAITQUEUE(&new_tcb->waitq);
+    timer_init(&new_tcb->timer, tcp_timer_expire);
+    circular_buf_init(&(new_tcb->rx_buf), TCP_BUF_SZ);
+
+    if (!new_tcb->rx_buf.buffer) {
+        slab_free(&tcb_cache, new_tcb);
+        return NULL;
+    }
+
+    return new_tcb;
 }
 
 /* Perform a 3-way handshake and establish a TCP connection. */
 tcb *tcp_connect(uint16_t port, uint32_t ip)
 {
     tcp_header header;
-    tcb *new_tcb = get_mem(sizeof(*new_tcb));
+    tcb *new_tcb = tcb_alloc();
 
-    memset(&header, 0, sizeof(header));
-    memset(new_tcb, 0, sizeof(*new_tcb));
+    if (!new_tcb)
+        return NULL;
 
-    circular_buf_init(&(new_tcb->rx_buf), TCP_BUF_SZ);
+    memset(&header, 0, sizeof(header));
 
     new_tcb->cur_seq_n = 1024;
     new_tcb->state = SYN_SENT;
-    new_tcb->timeout = TCP_TIMEOUT;
-    new_tcb->decrement_timeout = 1;
     new_tcb->src_port = 65355;
     new_tcb->dst_port = port;
     new_tcb->last_msg = &header;
@@ -372,30 +481,34 @@ tcb *tcp_connect(uint16_t port, uint32_t ip)
 
     header.syn = 1;
 
-    list_add(&new_tcb->tcb_next, &tcb_head);
+    tcb_link(new_tcb);
+    tcp_timer_start(new_tcb);
 
     tcp_tx(header, ip, NULL, 0);
 
-    wait_for_volatile_condition(new_tcb->state != SYN_SENT,
-                                tcp_waitq);;
+    wait_for_volatile_condition(new_tcb->state != SYN_SENT ||
+                                new_tcb->timed_out,
+                                new_tcb->waitq);
 
     if (new_tcb->state == ESTABLISHED)
         return new_tcb;
 
-    list_del(&new_tcb->tcb_next);
-    free_mem(new_tcb);
+    timer_stop(&new_tcb->timer);
+    tcb_unlink(new_tcb);
+    circular_buf_free(&new_tcb->rx_buf);
+    slab_free(&tcb_cache, new_tcb);
     return NULL;
 }
 
 tcb *tcp_listen(uint16_t port)
 {
     tcp_header header, resp;
-    tcb *new_tcb = get_mem(sizeof(*new_tcb));
+    tcb *new_tcb = tcb_alloc();
 
-    memset(&header, 0, sizeof(header));
-    memset(new_tcb, 0, sizeof(*new_tcb));
+    if (!new_tcb)
+        return NULL;
 
-    circular_buf_init(&(new_tcb->rx_buf), TCP_BUF_SZ);
+    memset(&header, 0, sizeof(header));
 
     new_tcb->cur_seq_n = 1024;
     new_tcb->state = LISTEN;
@@ -403,10 +516,10 @@ tcb *tcp_listen(uint16_t port)
     new_tcb->dst_port = 0;
     new_tcb->dst_ip = 0;
 
-    list_add(&new_tcb->tcb_next, &tcb_head);
+    tcb_link(new_tcb);
 
     wait_for_volatile_condition(new_tcb->state == SYN_RECEIVED,
-                                tcp_waitq);
+                                new_tcb->waitq);
 
     memset(&resp, 0, sizeof(resp));
 
@@ -418,12 +531,12 @@ tcb *tcp_listen(uint16_t port)
     tcp_tx(resp, new_tcb->dst_ip, NULL, 0);
 
     wait_for_volatile_condition(new_tcb->state == ESTABLISHED,
-                                tcp_waitq);
+                                new_tcb->waitq);
 
     return new_tcb;
 }
 
-void tcp_tx_data(tcb *connection, void *data, size_t len)
+int tcp_tx_data(tcb *connection, void *data, size_t len)
 {
     tcp_header header;
 
@@ -433,12 +546,15 @@ void tcp_tx_data(tcb *connection, void *data, size_t len)
 
     header.ack = 1;
 
-    connection->unacked_byte_count += len;
+    if (tcp_tx(header, connection->dst_ip, data, len))
+        return -ENOMEM;
 
-    tcp_tx(header, connection->dst_ip, data, len);
+    connection->unacked_byte_count += len;
 
     wait_for_volatile_condition(!connection->unacked_byte_count,
-                                tcp_waitq);
+                                connection->waitq);
+
+    return 0;
 }
 
 int tcp_rx_data(tcb *connection, void *dst_buf, size_t len)
@@ -449,7 +565,7 @@ int tcp_rx_data(tcb *connection, void *dst_buf, size_t len)
         wait_for_volatile_condition(
             (circular_buf_cur_usage(&connection->rx_buf) != 0)
             || connection->state == CLOSE_WAIT,
-            tcp_waitq);
+            connection->waitq);
 
         if (connection->state == CLOSE_WAIT)
             return -1;
@@ -499,29 +615,6 @@ void tcp_close(tcb *connection)
     }
 }
 
-void tcp_tick(void)
-{
-    list *i, *n;
-    list_for_each_safe(i, n, &tcb_head) {
-        tcb *cur = list_entry(i, tcb, tcb_next);
-        if (cur->decrement_timeout)
-            if (!cur->timeout--) {
-                cur->timed_out = 1;
-                cur->decrement_timeout = 0;
-
-                if (cur->state == TIME_WAIT) {
-                    list_del(&cur->tcb_next);
-                    circular_buf_free(&cur->rx_buf);
-                    free_mem(cur);
-                }
-            }
-    }
-}
-
-static struct tick_work_q tcp_tick_work = {
-    .tick_fn = tcp_tick
-};
-
 static struct protocol_t tcp_protocol  = {
     .rx_pkt = tcp_rx_packet,
     .type = TCP
@@ -529,7 +622,6 @@ static struct protocol_t tcp_protocol  = {
 
 void tcp_init(void)
 {
-    tick_add_work_fn(&tcp_tick_work);
     protocol_register(&tcp_protocol);
 }
 initcall(tcp_init);
@@ -1,6 +1,8 @@
 #pragma once
 #include "list.h"
 #include "cbuf.h"
+#include "wait.h"
+#include "timer.h"
 #include <stdint.h>
 #include <string.h>
 
@@ -45,25 +47,34 @@ typedef struct
     uint32_t unacked_byte_count;
     circular_buf rx_buf;
     enum tcp_state state;
-    uint16_t timeout;
     uint16_t src_port;
     uint16_t dst_port;
     uint16_t host_window_sz;
     uint32_t dst_ip;
-    uint8_t  decrement_timeout : 1;
     uint8_t  timed_out : 1;
     tcp_header *last_msg;
     list tcb_next;
+
+    /* Runs while waiting on the peer: the handshake and TIME_WAIT. */
+    struct timer timer;
+
+    /* Threads blocked on this connection. */
+    waitqueue_t waitq;
 } tcb;
 
-/* Perform a 3-way handshake and establish a TCP connection. */
+/* Perform a 3-way handshake and establish a TCP connection.
+ * @returns NULL if the connection could not be established. */
 tcb *tcp_connect(uint16_t port, uint32_t ip);
 
-/* Listen for an incoming connection on a specific port. */
+/* Listen for an incoming connection on a specific port.
+ * @returns NULL if out of memory. */
 tcb *tcp_listen(uint16_t port);
 
-/* Send data down an already-established TCP connection. */
-void tcp_tx_data(tcb *connection, void *data, size_t len);
+/* Send data down an already-established TCP connection.
+ *
+ * @returns 0 once the data has been acknowledged, -ENOMEM if it could
+ * not be sent for want of memory. */
+int tcp_tx_data(tcb *connection, void *data, size_t len);
 
 /* Receive data down an already-established TCP connection. */
 int tcp_rx_data(tcb *connection, void *dst_buf, size_t len);
@@ -1,51 +1,181 @@
 #include "irq.h"
 #include "lpc17xx.h"
 #include "tick.h"
+#include "timer.h"
+#include "tasklet.h"
 #include "process.h"
 #include "init.h"
 
-LIST(tick_work);
-static int timer0_irq_wakeups = 0;
+/* CCLK is 100MHZ.  When we divide this by 4 (as PCLK_TIMER0 is equal
+ * to 00 by default), we have a counter of 25MHZ. */
+#define TICK_PERIOD (5e-3)
+#define PCLOCK_FREQ (25e6)
+#define TICK_FREQ (1 / TICK_PERIOD)
+#define TIMER_COUNTER_INIT_VALUE PCLOCK_FREQ / TICK_FREQ
 
-void irq_timer0(void)
+/* Timer counts in a tick. */
+#define TICK_COUNTS ((uint32_t)(TIMER_COUNTER_INIT_VALUE))
+
+/* The longest the tick is stretched while idle. */
+#define TICK_IDLE_MAX TIMER_WHEEL_SLOTS
+
+/* A match register is never moved to within this many counts of the
+ * counter, so that the counter can't run past it while it is being
+ * written (40us). */
+#define TICK_MARGIN 1000
+
+/* Ticks since the last match that have already been run.  Ticks
+ * slept through are run when leaving idle, ahead of the match. */
+static uint32_t tick_done;
+
+/* Ticks passed that the tick tasklet has yet to run. */
+static volatile uint32_t tick_owed;
+
+/* @returns the number of ticks to run at the next match, more than 1
+ * while the tick is stretched. */
+static uint32_t tick_stretch(void)
 {
-    irq_flags_t flags = irq_disable();
-    timer0_irq_wakeups++;
+    return LPC_TIM0->MR0 / TICK_COUNTS - tick_done;
+}
+
+/* Run the timers that expire on the ticks passed. */
+static void tick_run(struct tasklet *tasklet)
+{
+    for (;;) {
+        irq_flags_t flags = irq_disable();
+
+        if (!tick_owed) {
+            irq_enable(flags);
+            break;
+        }
 
-    /* Invoke all tick functions. */
-    struct tick_work_q *i;
+        tick_owed--;
+        irq_enable(flags);
 
-    list_for_each(i, &tick_work, tick_work_l) {
-        i->tick_fn();
+        timer_tick();
     }
+}
 
-    irq_enable(flags);
+static TASKLET(tick_tasklet, tick_run);
+
+/* Leave `ticks' ticks for the tick tasklet to run.
+ *
+ * Should be called with interrupts disabled. */
+static void tick_defer(uint32_t ticks)
+{
+    tick_owed += ticks;
+    tasklet_schedule(&tick_tasklet);
+}
+
+void irq_timer0(void)
+{
+    irq_flags_t flags = irq_disable();
 
     /* Acknowledge the interrupt. */
     LPC_TIM0->IR = 0x1;
 
-    /* Raise a PendSV for context switch. */
-    LPC_SCB->ICSR |= ICSR_PENDSVSET_MASK;
+    /* Account for the ticks since the last match, and go back to
+     * ticking periodically.  The timers are run later, by the tick
+     * tasklet. */
+    tick_defer(tick_stretch());
+
+    LPC_TIM0->MR0 = TICK_COUNTS;
+    tick_done = 0;
+
+    /* Switch process, if there is another one due a turn. */
+    if (process_need_resched())
+        process_resched();
+
+    irq_enable(flags);
 }
 
-void tick_add_work_fn(struct tick_work_q *new_work)
+uint32_t tick_lag(void)
 {
-    irq_flags_t flags = irq_disable();
-    list_add(&new_work->tick_work_l, &tick_work);
-    irq_enable(flags);
+    uint32_t tc = LPC_TIM0->TC;
+    uint32_t passed;
+
+    /* Once the stretched tick has matched, all of it has passed. */
+    if (LPC_TIM0->IR & 0x1)
+        passed = tick_stretch();
+    else
+        passed = tc / TICK_COUNTS - tick_done;
+
+    return tick_owed + passed;
 }
 
-void tick_init(void)
+void tick_idle_enter(void)
 {
-    /* CCLK is 100MHZ.  When we divide this by 4 (as PCLK_TIMER0 is
-     * equal to 00 by default), we have a counter of 25MHZ. */
-#define TICK_PERIOD (5e-3)
-#define PCLOCK_FREQ (25e6)
-#define TICK_FREQ (1 / TICK_PERIOD)
-#define TIMER_COUNTER_INIT_VALUE PCLOCK_FREQ / TICK_FREQ
+    uint32_t tc, match;
+
+    /* The next expiry can't be known until the timers have caught
+     * up. */
+    if (tick_owed)
+        return;
+
+    /* This is worked out afresh every time the idle task goes back to
+     * sleep, as an interrupt handler or tasklet may have started a
+     * timer that expires before the tick already stretched. */
+    match = (tick_done + timer_next_expiry(TICK_IDLE_MAX)) * TICK_COUNTS;
+
+    if (match == LPC_TIM0->MR0)
+        return;
+
+    /* The counter is part way through the current tick.  If it has
+     * matched, or is about to, leave it to tick normally. */
+    tc = LPC_TIM0->TC;
+
+    if (LPC_TIM0->IR & 0x1 || LPC_TIM0->MR0 - tc < TICK_MARGIN)
+        return;
+
+    /* The counter may already be past the new deadline, or too close
+     * to it.  Match at the next tick boundary it can safely be moved
+     * to instead; the ticks passed are run there. */
+    if (match < tc + TICK_MARGIN) {
+        match = (tc / TICK_COUNTS + 1) * TICK_COUNTS;
+
+        if (match - tc < TICK_MARGIN)
+            match += TICK_COUNTS;
+    }
 
+    LPC_TIM0->MR0 = match;
+}
+
+void tick_idle_exit(void)
+{
+    uint32_t tc, ticks, next;
+
+    if (tick_stretch() == 1)
+        return;
+
+    tc = LPC_TIM0->TC;
+
+    /* The stretched tick has matched, or is about to; the interrupt
+     * catches up. */
+    if (LPC_TIM0->IR & 0x1 || LPC_TIM0->MR0 - tc < TICK_MARGIN)
+        return;
+
+    /* Catch up on the ticks slept through.  No timer expires on
+     * them, or the tick wouldn't have been stretched past them. */
+    ticks = tc / TICK_COUNTS - tick_done;
+    tick_done += ticks;
+
+    if (ticks)
+        tick_defer(ticks);
+
+    /* Match again at the end of the current tick, or the one after
+     * if that is too close. */
+    next = (tc / TICK_COUNTS + 1) * TICK_COUNTS;
+
+    if (next - tc < TICK_MARGIN)
+        next += TICK_COUNTS;
+
+    LPC_TIM0->MR0 = next;
+}
+
+void tick_init(void)
+{
     LPC_TIM0->PR = 0x0;
-    LPC_TIM0->MR0 = TIMER_COUNTER_INIT_VALUE;
+    LPC_TIM0->MR0 = TICK_COUNTS;
 
     /* Clear the timer and prescale counter registers. */
     LPC_TIM0->TC = 0x0;
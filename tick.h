@@ -1,9 +1,29 @@
 #pragma once
-#include "list.h"
 
-struct tick_work_q {
-    void (*tick_fn)(void);
-    list tick_work_l;
-};
+#include <stdint.h>
 
-void tick_add_work_fn(struct tick_work_q *new_work);
+/*
+ * Tickless idle.
+ *
+ * While only the idle task can run, the periodic tick is stretched
+ * out to the next timer deadline, so an idle system isn't woken
+ * every tick for nothing.  Time is still kept in whole ticks: the
+ * ticks slept through are accounted for when the tick comes back.
+ * Timer resolution therefore stays at one tick (5ms), stretched or
+ * not.
+ *
+ * All of these should be called with interrupts disabled.
+ */
+
+/* @returns the number of ticks that have passed but whose timers
+ * have yet to be run, so that timers started from an interrupt
+ * handler or tasklet while the tick is stretched count from now. */
+uint32_t tick_lag(void);
+
+/* Stretch the tick out to the next timer deadline.  Called by the
+ * idle task before it sleeps. */
+void tick_idle_enter(void);
+
+/* Catch up on the ticks slept through and go back to ticking
+ * periodically.  Called when switching away from the idle task. */
+void tick_idle_exit(void);
@@ -0,0 +1,143 @@
+#include "timer.h"
+#include "irq.h"
+#include "init.h"
+#include "tick.h"
+#include <stddef.h>
+
+static list timer_wheel[TIMER_WHEEL_SLOTS];
+
+volatile uint32_t timer_ticks;
+
+/* Should be called with interrupts disabled. */
+static void timer_enqueue(struct timer *timer, uint32_t expires)
+{
+    timer->expires = expires;
+    list_add_tail(&timer->entry,
+                  &timer_wheel[expires % TIMER_WHEEL_SLOTS]);
+}
+
+void timer_init(struct timer *timer, timer_fn_t fn)
+{
+    /* A timer that isn't on the wheel has a NULL entry, as left by
+     * list_del(). */
+    timer->entry.next = timer->entry.prev = NULL;
+    timer->period = 0;
+    timer->fn = fn;
+}
+
+int timer_pending(struct timer *timer)
+{
+    return timer->entry.next != NULL;
+}
+
+static void __timer_start(struct timer *timer, uint32_t ticks,
+                          uint32_t period)
+{
+    irq_flags_t flags = irq_disable();
+
+    if (timer_pending(timer))
+        list_del(&timer->entry);
+
+    /* A timer started for 0 ticks expires on the next one. */
+    if (!ticks)
+        ticks = 1;
+
+    /* Count from now, rather than from the last tick run. */
+    timer->period = period;
+    timer_enqueue(timer, timer_ticks + tick_lag() + ticks);
+
+    irq_enable(flags);
+}
+
+void timer_start(struct timer *timer, uint32_t ticks)
+{
+    __timer_start(timer, ticks, 0);
+}
+
+void timer_start_periodic(struct timer *timer, uint32_t period)
+{
+    __timer_start(timer, period, period);
+}
+
+void timer_stop(struct timer *timer)
+{
+    irq_flags_t flags = irq_disable();
+
+    if (timer_pending(timer))
+        list_del(&timer->entry);
+
+    irq_enable(flags);
+}
+
+uint32_t timer_next_expiry(uint32_t max)
+{
+    uint32_t ticks;
+
+    /* Look through the slots in the order they come due.  A timer
+     * due on a later turn of the wheel is at least a turn away. */
+    for (ticks = 1; ticks < max; ticks++) {
+        uint32_t expires = timer_ticks + ticks;
+        struct timer *timer;
+
+        list_for_each(timer, &timer_wheel[expires % TIMER_WHEEL_SLOTS],
+                      entry) {
+            if (timer->expires == expires)
+                return ticks;
+        }
+    }
+
+    return max;
+}
+
+void timer_tick(void)
+{
+    list *slot, *i, *tmp;
+    LIST(expired);
+    struct timer *timer;
+    irq_flags_t flags = irq_disable();
+
+    timer_ticks++;
+    slot = &timer_wheel[timer_ticks % TIMER_WHEEL_SLOTS];
+
+    /* Take the expiring timers off the wheel before running any of
+     * them, as their functions may start and stop other timers. */
+    list_for_each_safe(i, tmp, slot) {
+        timer = list_entry(i, struct timer, entry);
+
+        /* Due on a later turn of the wheel. */
+        if (timer->expires != timer_ticks)
+            continue;
+
+        list_del(&timer->entry);
+        list_add_tail(&timer->entry, &expired);
+    }
+
+    irq_enable(flags);
+
+    /* Run them with interrupts enabled.  A timer may be stopped or
+     * restarted by an interrupt handler meanwhile, which takes it
+     * off `expired'. */
+    for (;;) {
+        flags = irq_disable();
+        list_pop(timer, &expired, entry);
+
+        if (timer && timer->period)
+            timer_enqueue(timer, timer_ticks + timer->period);
+
+        irq_enable(flags);
+
+        if (!timer)
+            break;
+
+        timer->fn(timer);
+    }
+}
+
+static void timer_wheel_init(void)
+{
+    int i;
+
+    for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+        INIT_LIST(&timer_wheel[i]);
+}
+early_initcall(timer_wheel_init);
@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include "list.h"
+
+/*
+ * Timers.
+ *
+ * One-shot and periodic timers, counted in ticks of the system timer
+ * and kept in a hashed timing wheel: a timer due at tick `t' sits in
+ * slot `t % TIMER_WHEEL_SLOTS'.  Starting and stopping a timer is
+ * constant time, and each tick only looks at the timers in the slot
+ * for that tick.  Timers further away than a turn of the wheel share
+ * a slot with nearer ones and are skipped until their turn comes.
+ *
+ * Timer functions run from the tick tasklet (see tasklet.h), with
+ * interrupts enabled, and must not block.
+ */
+
+#define TIMER_WHEEL_SLOTS 256
+
+struct timer;
+
+typedef void (*timer_fn_t)(struct timer *timer);
+
+struct timer
+{
+    list entry;
+    uint32_t expires;
+
+    /* Ticks between expiries of a periodic timer, 0 for a one-shot
+     * timer. */
+    uint32_t period;
+
+    timer_fn_t fn;
+};
+
+/* Ticks since boot. */
+extern volatile uint32_t timer_ticks;
+
+/* @returns the number of ticks left until `deadline', a value of
+ * timer_ticks, or 0 once it has passed. */
+static inline uint32_t timer_ticks_left(uint32_t deadline)
+{
+    int32_t left = deadline - timer_ticks;
+
+    return left > 0 ? left : 0;
+}
+
+/* Set up `timer' to call `fn' on expiry.  Must be called before any
+ * other timer function. */
+void timer_init(struct timer *timer, timer_fn_t fn);
+
+/* (Re)start `timer' to expire once, `ticks' ticks from now. */
+void timer_start(struct timer *timer, uint32_t ticks);
+
+/* (Re)start `timer' to expire every `period' ticks. */
+void timer_start_periodic(struct timer *timer, uint32_t period);
+
+/* Stop `timer' if it is running.  Once this returns, its function
+ * won't be called until it is started again. */
+void timer_stop(struct timer *timer);
+
+/* @returns 1 if `timer' is running, 0 otherwise. */
+int timer_pending(struct timer *timer);
+
+/* @returns the number of ticks until the next timer expires, or
+ * `max' if none expire sooner.  `max' may be at most
+ * TIMER_WHEEL_SLOTS.
+ *
+ * Should be called with interrupts disabled. */
+uint32_t timer_next_expiry(uint32_t max);
+
+/* Advance time by a tick and run the timers that expire.  Called
+ * from the tick tasklet. */
+void timer_tick(void);
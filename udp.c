@@ -2,7 +2,6 @@
 #include "ipv4.h"
 #include "irq.h"
 #include "byteswap.h"
-#include "memory.h"
 #include "init.h"
 #include "protocol.h"
 #include "list.h"
@@ -17,9 +16,11 @@ typedef struct
     uint16_t dst_buf_ptr;
     uint16_t port;
     list rx_requests;
+
+    /* The thread blocked in udp_rx() for this port. */
+    waitqueue_t waitq;
 }udp_listener;
 
-static WAITQUEUE(udp_waitq);
 static LIST(udp_rx_requests);
 
 static void udp_swap_endian(udp_header *header)
@@ -42,13 +43,14 @@ int udp_rx(uint16_t port, void *dst_buf, uint16_t dst_buf_sz)
     newListener.dst_buf = dst_buf;
     newListener.dst_buf_sz = dst_buf_sz;
     newListener.dst_buf_ptr = 0;
+    INIT_WAITQUEUE(&newListener.waitq);
 
     list_add(&newListener.rx_requests, &udp_rx_requests);
     irq_enable(flags);
 
     wait_for_volatile_condition(newListener.dst_buf_ptr ==
                                 newListener.dst_buf_sz,
-                                udp_waitq);
+                                newListener.waitq);
 
     flags = irq_disable();
     list_del(&newListener.rx_requests);
@@ -90,31 +92,39 @@ void udp_rx_packet(struct packet_t *pkt)
             memcpy(i->dst_buf + i->dst_buf_ptr, udp_payload, no_bytes_to_copy);
 
             i->dst_buf_ptr += no_bytes_to_copy;
-            waitqueue_wakeup(&udp_waitq);
+            waitqueue_wakeup_one(&i->waitq);
         }
     }
     irq_enable(flags);
 }
 
-void udp_xmit_packet(uint16_t dst_port, uint32_t dst_ip, void *payload,
-                     int payload_len)
+int udp_xmit_packet(uint16_t dst_port, uint32_t dst_ip, void *payload,
+                    int payload_len)
 {
-    int packet_buf_len = sizeof(udp_header) + payload_len;
-    void *packet_buf = get_mem(packet_buf_len);
-    udp_header *header = (udp_header *)packet_buf;
+    struct packet_t *pkt = packet_alloc_tx(0);
+    udp_header *header;
+
+    if (!pkt)
+        return -ENOMEM;
 
+    /* The payload gets a buffer of its own, chained behind the one the
+     * headers are built in. */
+    if (packet_append(pkt, payload, payload_len)) {
+        packet_destroy(pkt);
+        return -ENOMEM;
+    }
+
+    header = packet_push(pkt, sizeof(*header));
     header->src_port = 0;
     header->dst_port = dst_port;
-    header->length = packet_buf_len;
+    header->length = packet_len(pkt);
     header->checksum = 0;
 
     udp_swap_endian(header);
 
-    memcpy(packet_buf + sizeof(*header), payload, payload_len);
-
-    ip4_xmit_packet(IP_PROTO_UDP, dst_ip, packet_buf, packet_buf_len);
+    ip4_xmit_packet(IP_PROTO_UDP, dst_ip, pkt);
 
-    free_mem(packet_buf);
+    return 0;
 }
 
 static struct protocol_t udp_procotol = {
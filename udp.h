@@ -10,5 +10,8 @@ typedef struct {
 
 int udp_rx(uint16_t port, void *dst_buf, uint16_t dst_buf_sz);
 
-void udp_xmit_packet(uint16_t dst_port, uint32_t dst_ip, void *payload,
-                     int payload_len);
+/* Send `payload' in a UDP datagram.
+ *
+ * @returns 0 on success, -ENOMEM if out of memory. */
+int udp_xmit_packet(uint16_t dst_port, uint32_t dst_ip, void *payload,
+                    int payload_len);
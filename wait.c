@@ -1,34 +1,69 @@
-#include "memory.h"
 #include "process.h"
 #include "wait.h"
-
-typedef struct
-{
-    list queue;
-    process_t *proc;
-} waiting_proc_t;
+#include <stddef.h>
 
 void __waitqueue_wait(waitqueue_t *waitq)
 {
-    waiting_proc_t *newwait = get_mem(sizeof(*newwait));
-    newwait->proc = process_get_cur_task();
-    list_add(&newwait->queue, waitq);
+    process_t *proc = process_get_cur_task();
+
+    /* A process waits on one queue at a time, so its own entry is all
+     * it takes to queue it; waiting never allocates. */
+    list_add_tail(&proc->wait_entry, waitq);
     process_wait();
 }
 
+static void wait_timer_expire(struct timer *timer)
+{
+    struct wait_timer *wait_timer =
+        list_entry(timer, struct wait_timer, timer);
+    process_t *proc = wait_timer->proc;
+    irq_flags_t flags = irq_disable();
+
+    wait_timer->expired = 1;
+
+    /* If it is still asleep, take it off its waitqueue.  Otherwise it
+     * has already been woken, and sees `expired' when it next checks
+     * its condition. */
+    if (proc->wait_entry.next) {
+        list_del(&proc->wait_entry);
+        process_wakeup(proc);
+    }
+
+    irq_enable(flags);
+}
+
+void __wait_timer_start(struct wait_timer *wait_timer, uint32_t ticks)
+{
+    wait_timer->proc = process_get_cur_task();
+    wait_timer->expired = 0;
+    timer_init(&wait_timer->timer, wait_timer_expire);
+    timer_start(&wait_timer->timer, ticks);
+}
+
 void waitqueue_wakeup(waitqueue_t *waitq)
 {
     list *i, *tmp;
     irq_flags_t flags = irq_disable();
 
     list_for_each_safe(i, tmp, waitq) {
-        waiting_proc_t *waitproc =
-            list_entry(i, waiting_proc_t, queue);
+        process_t *proc = list_entry(i, process_t, wait_entry);
 
-        process_wakeup(waitproc->proc);
-        list_del(&waitproc->queue);
-        free_mem(waitproc);
+        list_del(&proc->wait_entry);
+        process_wakeup(proc);
     }
 
     irq_enable(flags);
 }
+
+void waitqueue_wakeup_one(waitqueue_t *waitq)
+{
+    process_t *proc;
+    irq_flags_t flags = irq_disable();
+
+    list_pop(proc, waitq, wait_entry);
+
+    if (proc)
+        process_wakeup(proc);
+
+    irq_enable(flags);
+}
@@ -2,25 +2,75 @@
 
 #include "irq.h"
 #include "process.h"
+#include "timer.h"
+#include "error.h"
 
+/* Sleep on `waitq' until `condition' holds.  `waitq' may be any
+ * lvalue expression naming a waitqueue_t, such as a member of the
+ * object being waited on. */
 #define wait_for_volatile_condition(condition, waitq)    \
     ({                                                   \
         for (;;) {                                       \
-            irq_flags_t flags_##waitq;                   \
+            irq_flags_t __wait_flags;                    \
             asm volatile("" : : : "memory");             \
-            flags_##waitq = irq_disable();               \
+            __wait_flags = irq_disable();                \
             if (condition) {                             \
-                irq_enable(flags_##waitq);               \
+                irq_enable(__wait_flags);                \
                 break;                                   \
             }                                            \
-            __waitqueue_wait(&waitq);                    \
+            __waitqueue_wait(&(waitq));                  \
         }                                                \
     })
 
+/* As wait_for_volatile_condition(), but give up after `ticks' ticks.
+ *
+ * @returns 0 once `condition' holds, -ETIMEDOUT if it didn't in
+ * time. */
+#define wait_for_volatile_condition_timeout(condition, waitq, ticks)   \
+    ({                                                                  \
+        struct wait_timer __wait_timer;                                 \
+        int __wait_ret = 0;                                             \
+        __wait_timer_start(&__wait_timer, ticks);                       \
+        for (;;) {                                                      \
+            irq_flags_t __wait_flags;                                   \
+            asm volatile("" : : : "memory");                            \
+            __wait_flags = irq_disable();                               \
+            if (condition) {                                            \
+                irq_enable(__wait_flags);                               \
+                break;                                                  \
+            }                                                           \
+            if (__wait_timer.expired) {                                 \
+                irq_enable(__wait_flags);                               \
+                __wait_ret = -ETIMEDOUT;                                \
+                break;                                                  \
+            }                                                           \
+            __waitqueue_wait(&(waitq));                                 \
+        }                                                               \
+        timer_stop(&__wait_timer.timer);                                \
+        __wait_ret;                                                     \
+    })
+
 typedef list waitqueue_t;
 
+/* Takes a process waiting with a timeout off its waitqueue once the
+ * timeout expires. */
+struct wait_timer
+{
+    struct timer timer;
+    process_t *proc;
+    volatile int expired;
+};
+
+void __wait_timer_start(struct wait_timer *wait_timer, uint32_t ticks);
+
 #define WAITQUEUE(name) \
     waitqueue_t name = __LIST_INIT(name)
 
+#define INIT_WAITQUEUE(ptr) INIT_LIST(ptr)
+
 void __waitqueue_wait(waitqueue_t *waitq);
 void waitqueue_wakeup(waitqueue_t *waitq);
+
+/* Wake only the process that has been waiting on `waitq' the longest,
+ * for queues where any one waiter can consume what became available. */
+void waitqueue_wakeup_one(waitqueue_t *waitq);